@@ -41,6 +41,7 @@
 #include "pub_core_libcprint.h"
 #include "pub_core_libcproc.h"     /* VG_(read_millisecond_timer) */
 #include "pub_core_libcfile.h"
+#include "pub_core_debuginfo.h"    /* VG_(lzo1x_1_compress) */
 #include "priv_misc.h"             /* dinfo_zalloc/free/strdup */
 #include "priv_image.h"            /* self */
 
@@ -1040,6 +1041,19 @@ UInt ML_(img_calc_gnu_debuglink_crc32)(DiImage* img)
 ////////////////////////////////////////////////////
 #include "minilzo-inl.c"
 
+/* Exported to tools, see pub_tool_debuginfo.h */
+SizeT VG_(lzo1x_1_compress) ( const UChar* src, SizeT src_len,
+                              /*OUT*/UChar* dst, void* wrkmem )
+{
+   lzo_uint dst_len = 0;
+   Int rc;
+
+   vg_assert(VG_LZO1X_1_MEM_COMPRESS == LZO1X_1_MEM_COMPRESS);
+   rc = lzo1x_1_compress(src, src_len, dst, &dst_len, wrkmem);
+   vg_assert(rc == LZO_E_OK);
+   return dst_len;
+}
+
 /*--------------------------------------------------------------------*/
 /*--- end                                                  image.c ---*/
 /*--------------------------------------------------------------------*/
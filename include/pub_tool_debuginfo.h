@@ -252,6 +252,27 @@ VgSectKind VG_(DebugInfo_sect_kind)( /*OUT*/HChar* name, SizeT n_name,
                                      Addr a);
 
 
+/*====================================================================*/
+/*=== LZO1X compression                                            ===*/
+/*====================================================================*/
+
+/* The copy of minilzo used for compressed debuginfo images, exported
+   for tools writing compressed output of their own. */
+
+/* Bytes of work memory needed by VG_(lzo1x_1_compress). */
+#define VG_LZO1X_1_MEM_COMPRESS  (16384 * sizeof(UChar*))
+
+/* Max bytes written by VG_(lzo1x_1_compress) for 'n' input bytes. */
+#define VG_LZO1X_1_MAX_OUTPUT(n) ((n) + (n) / 16 + 64 + 3)
+
+/* Compress 'src_len' bytes at 'src' into 'dst', which must hold
+   VG_LZO1X_1_MAX_OUTPUT(src_len) bytes.  'wrkmem' must hold
+   VG_LZO1X_1_MEM_COMPRESS bytes.  Returns the compressed length.
+   The output is decompressed with lzo1x_decompress_safe. */
+extern SizeT VG_(lzo1x_1_compress) ( const UChar* src, SizeT src_len,
+                                     /*OUT*/UChar* dst, void* wrkmem );
+
+
 #endif   // __PUB_TOOL_DEBUGINFO_H
 
 /*--------------------------------------------------------------------*/
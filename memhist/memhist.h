@@ -21,10 +21,21 @@ typedef
       VG_USERREQ__SET_PROTECTION,
       VG_USERREQ__CLEAR_PROTECTION,
       VG_USERREQ__DISABLE_PROTECTION,
-      VG_USERREQ__ENABLE_PROTECTION
+      VG_USERREQ__ENABLE_PROTECTION,
+      VG_USERREQ__DUMP_HISTORY_FILE,
+      VG_USERREQ__DUMP_HISTORY,
+      VG_USERREQ__LAST_WRITER,
+      VG_USERREQ__TRACK_THREAD_FILTER,
+      VG_USERREQ__TRACK_CHANGES_ONLY,
+      VG_USERREQ__TRACK_SAMPLE_RATE,
+      VG_USERREQ__SET_PROTECTION_VEC,
+      VG_USERREQ__CLEAR_PROTECTION_VEC
 
    } Vg_MemHistClientRequest;
 
+/* Record the last _qzz_history writes to each _qzz_granularity bytes word
+   in [_qzz_addr, _qzz_addr+_qzz_len). With _qzz_history 0 only count
+   writes per word and stack, as with --summary=heatmap. */
 #define VALGRIND_TRACK_MEM_WRITE(_qzz_addr,_qzz_len, _qzz_granularity, _qzz_history, _qzz_name)	\
     VALGRIND_DO_CLIENT_REQUEST_EXPR(0 /* default return */,     \
                             VG_USERREQ__TRACK_MEM_WRITE,        \
@@ -45,6 +56,33 @@ typedef
                             VG_USERREQ__TRACK_DISABLE,        \
                             (_qzz_addr), (_qzz_len), 0, 0, 0)
 
+#define VG_TRACK_ALL_THREADS 0  /* record writes from all threads (default) */
+#define VG_TRACK_NOT_OWNER   1  /* record writes from all threads but tid */
+#define VG_TRACK_THREAD      2  /* record only writes from tid and other
+				   threads added the same way */
+
+/* Select which threads' writes are recorded in a tracked region.
+   tid is a Valgrind thread id as shown in history, 0 for calling thread. */
+#define VALGRIND_TRACK_THREAD_FILTER(_qzz_addr,_qzz_len,_qzz_filter,_qzz_tid) \
+    VALGRIND_DO_CLIENT_REQUEST_EXPR(0 /* default return */,     \
+                            VG_USERREQ__TRACK_THREAD_FILTER,        \
+                            (_qzz_addr), (_qzz_len), (_qzz_filter), (_qzz_tid), 0)
+
+/* With _qzz_on nonzero, stores to a tracked region that do not change its
+   contents are not recorded. Stores by helper calls, such as fxsave, are
+   always recorded. */
+#define VALGRIND_TRACK_CHANGES_ONLY(_qzz_addr,_qzz_len,_qzz_on) \
+    VALGRIND_DO_CLIENT_REQUEST_EXPR(0 /* default return */,     \
+                            VG_USERREQ__TRACK_CHANGES_ONLY,        \
+                            (_qzz_addr), (_qzz_len), (_qzz_on), 0, 0)
+
+/* Record only one in _qzz_rate writes to a tracked region, as with
+   --sample-rate. All writes are still counted. */
+#define VALGRIND_TRACK_SAMPLE_RATE(_qzz_addr,_qzz_len,_qzz_rate) \
+    VALGRIND_DO_CLIENT_REQUEST_EXPR(0 /* default return */,     \
+                            VG_USERREQ__TRACK_SAMPLE_RATE,        \
+                            (_qzz_addr), (_qzz_len), (_qzz_rate), 0, 0)
+
 #define VG_MEM_NOWRITE 1
 #define VG_MEM_NOREAD 2
 #define VG_MEM_NOEXE 4
@@ -59,6 +97,25 @@ typedef
                             VG_USERREQ__CLEAR_PROTECTION,        \
 			    (_qzz_addr), (_qzz_len), (_qzz_prot), 0, 0)
 
+/* Address range for the vectored requests below */
+struct vg_mem_range {
+    void* addr;
+    unsigned long len;
+};
+
+/* Same as VALGRIND_SET_PROTECTION and VALGRIND_CLEAR_PROTECTION for
+   each of the _qzz_n ranges in array _qzz_ranges, in one request.
+   The ranges need not be sorted and may overlap. */
+#define VALGRIND_SET_PROTECTION_VEC(_qzz_ranges,_qzz_n, _qzz_name, _qzz_prot) \
+    VALGRIND_DO_CLIENT_REQUEST_EXPR(0 /* default return */,     \
+                            VG_USERREQ__SET_PROTECTION_VEC,        \
+			    (_qzz_ranges), (_qzz_n), (_qzz_name), (_qzz_prot), 0)
+
+#define VALGRIND_CLEAR_PROTECTION_VEC(_qzz_ranges,_qzz_n, _qzz_prot)	\
+    VALGRIND_DO_CLIENT_REQUEST_EXPR(0 /* default return */,     \
+                            VG_USERREQ__CLEAR_PROTECTION_VEC,        \
+			    (_qzz_ranges), (_qzz_n), (_qzz_prot), 0, 0)
+
 
 #define VALGRIND_SET_WRITABLE(A,S) VALGRIND_CLEAR_PROTECTION((A), (S), VG_MEM_NOWRITE)
 #define VALGRIND_SET_READONLY(A,S,N) VALGRIND_SET_PROTECTION((A), (S), (N), VG_MEM_NOWRITE)
@@ -70,7 +127,31 @@ typedef
 
 #define VALGRIND_ENABLE_PROTECTION() \
    VALGRIND_DO_CLIENT_REQUEST_EXPR(0 /* default return */,     \
-			   VG_USERREQ__DISABLE_PROTECTION,        \
+			   VG_USERREQ__ENABLE_PROTECTION,        \
 			   0, 0, 0, 0, 0)
 
+/* Write all recorded history to binary file, see mh_trace_format.h.
+   The file name is used as is, '%p' etc are not expanded.
+   Returns 1 if file was written. */
+#define VALGRIND_MEMHIST_DUMP_FILE(_qzz_filename) \
+   VALGRIND_DO_CLIENT_REQUEST_EXPR(0 /* default return */,     \
+			   VG_USERREQ__DUMP_HISTORY_FILE,        \
+			   (_qzz_filename), 0, 0, 0, 0)
+
+/* Print recorded history of all tracked words in [addr,addr+len),
+   or their write counts for regions in heatmap mode */
+#define VALGRIND_MEMHIST_DUMP(_qzz_addr,_qzz_len) \
+   VALGRIND_DO_CLIENT_REQUEST_EXPR(0 /* default return */,     \
+			   VG_USERREQ__DUMP_HISTORY,        \
+			   (_qzz_addr), (_qzz_len), 0, 0, 0)
+
+/* Get call stack of last recorded write to the word at addr.
+   Up to buflen return addresses are stored in the void* array buf.
+   Returns the number stored, 0 if addr is not tracked or not written
+   or its region is in heatmap mode. */
+#define VALGRIND_MEMHIST_LAST_WRITER(_qzz_addr,_qzz_buf,_qzz_buflen) \
+   VALGRIND_DO_CLIENT_REQUEST_EXPR(0 /* default return */,     \
+			   VG_USERREQ__LAST_WRITER,        \
+			   (_qzz_addr), (_qzz_buf), (_qzz_buflen), 0, 0)
+
 #endif // __MEMHIST_H
@@ -35,12 +35,22 @@
 #include "pub_tool_options.h"
 #include "pub_tool_machine.h"     // VG_(fnptr_to_fnentry)
 #include "pub_tool_execontext.h"
+#include "pub_tool_stacktrace.h"
 #include "pub_tool_threadstate.h"
 #include "pub_tool_mallocfree.h"
+#include "pub_tool_poolalloc.h"
+#include "pub_tool_replacemalloc.h"
+#include "pub_tool_hashtable.h"
+#include "pub_tool_seqmatch.h"
+#include "pub_tool_libcfile.h"
+#include "pub_tool_vki.h"
+#include "pub_tool_gdbserver.h"
+#include "pub_tool_aspacemgr.h"   // VG_(am_is_valid_for_client)
 
 #include "memhist.h"  // client requests
 
 #include "rb_tree.h"
+#include "mh_trace_format.h"
 
 //#define MH_DEBUG
 
@@ -61,12 +71,38 @@
 
 /* Command line options controlling instrumentation kinds */
 static Bool clo_trace_mem = False;
+static Bool clo_discard_when_empty = False;
+
+/* How to capture call stacks for history records */
+enum mh_history_stack {
+    MH_STACK_FULL,   /* ExeContext at time of store */
+    MH_STACK_IP,     /* Only the guest IP */
+    MH_STACK_LAZY    /* Raw IPs, interned when reported */
+};
+static enum mh_history_stack clo_history_stack = MH_STACK_FULL;
+static const HChar* clo_trace_file = NULL;
+static const HChar* clo_dump_file = NULL;
+static Bool clo_dump_at_exit = True;
+static Bool clo_count_instrs = False;
+static Bool clo_false_sharing = False;
+static Long clo_false_sharing_window = 1000;
+static Bool clo_summary_heatmap = False;
+static Bool clo_heatmap_words = False;
+static Long clo_sample_rate = 1;
+static const HChar* clo_track_alloc = NULL;
+static SizeT clo_track_alloc_min = 0;
+static SizeT clo_track_alloc_max = 0;   /* 0 if no --track-alloc-size */
+static Long clo_track_alloc_history = 4;
 
 enum mh_track_type {
     MH_WRITE  = 1,   /* Data store */
     MH_READ   = 2,   /* Data load */
     MH_EXE    = 4,   /* Instruction execution */
-    MH_TRACK  = 8
+    MH_TRACK  = 8,
+
+    /* Access types only, for dirty helper stores */
+    MH_WRITE_CHECK = 16,  /* before the store, check protection */
+    MH_WRITE_DONE  = 32   /* after the store, record it */
 };
 
 enum mh_track_type enabled_tracking = MH_WRITE | MH_READ;
@@ -74,7 +110,36 @@ enum mh_track_type enabled_tracking = MH_WRITE | MH_READ;
 static Bool mh_process_cmd_line_option(const HChar* arg)
 {
     const HChar* prot_str;
+    const HChar* size_str;
     if VG_BOOL_CLO(arg, "--trace-mem", clo_trace_mem) {}
+    else if VG_BOOL_CLO(arg, "--discard-when-empty", clo_discard_when_empty) {}
+    else if VG_XACT_CLO(arg, "--history-stack=full", clo_history_stack, MH_STACK_FULL) {}
+    else if VG_XACT_CLO(arg, "--history-stack=ip", clo_history_stack, MH_STACK_IP) {}
+    else if VG_XACT_CLO(arg, "--history-stack=lazy", clo_history_stack, MH_STACK_LAZY) {}
+    else if VG_STR_CLO(arg, "--trace-file", clo_trace_file) {}
+    else if VG_STR_CLO(arg, "--dump-file", clo_dump_file) {}
+    else if VG_BOOL_CLO(arg, "--dump-at-exit", clo_dump_at_exit) {}
+    else if VG_BOOL_CLO(arg, "--count-instrs", clo_count_instrs) {}
+    else if VG_BOOL_CLO(arg, "--false-sharing", clo_false_sharing) {}
+    else if VG_XACT_CLO(arg, "--summary=history", clo_summary_heatmap, False) {}
+    else if VG_XACT_CLO(arg, "--summary=heatmap", clo_summary_heatmap, True) {}
+    else if VG_BOOL_CLO(arg, "--heatmap-words", clo_heatmap_words) {}
+    else if VG_BINT_CLO(arg, "--sample-rate", clo_sample_rate, 1, 1000000000) {}
+    else if VG_BINT_CLO(arg, "--false-sharing-window",
+			clo_false_sharing_window, 1, 1000000000) {}
+    else if VG_STR_CLO(arg, "--track-alloc", clo_track_alloc) {}
+    else if VG_BINT_CLO(arg, "--track-alloc-history",
+			clo_track_alloc_history, 0, 1000000) {}
+    else if (VG_STR_CLO(arg, "--track-alloc-size", size_str)) {
+	HChar* end;
+	clo_track_alloc_min = VG_(strtoll10)(size_str, &end);
+	clo_track_alloc_max = clo_track_alloc_min;
+	if (*end == '-')
+	    clo_track_alloc_max = VG_(strtoll10)(end + 1, &end);
+	if (*end || end == size_str || !clo_track_alloc_max
+	    || clo_track_alloc_max < clo_track_alloc_min)
+	    VG_(fmsg_bad_option)(arg, "Expected <n> or <min>-<max> with 0 < <n>\n");
+    }
     else if (VG_STR_CLO(arg, "--enable-tracking", prot_str)) {
 	enabled_tracking = 0;
 	while (*prot_str) {
@@ -95,7 +160,7 @@ static Bool mh_process_cmd_line_option(const HChar* arg)
 	    ++prot_str;
 	}
     }
-    else return False;
+    else return VG_(replacement_malloc_process_cmd_line_option)(arg);
 
     return True;
 }
@@ -104,6 +169,26 @@ static void mh_print_usage(void)
 {
     VG_(printf)("    --trace-mem=no|yes         trace all stores [no]\n");
     VG_(printf)("    --enable-tracking=[RWX]*   enable tracking of all Reads, Writes and/or eXecution [RW]\n");
+    VG_(printf)("    --discard-when-empty=no|yes  stop instrumenting when last region is removed [no]\n");
+    VG_(printf)("    --history-stack=full|ip|lazy call stack saved for each tracked write [full]\n");
+    VG_(printf)("    --trace-file=<file>        log all tracked writes to binary <file> [none]\n");
+    VG_(printf)("    --dump-file=<file>         write binary history dump to <file> at exit [none]\n");
+    VG_(printf)("    --dump-at-exit=no|yes      print history of all tracked regions at exit [yes]\n");
+    VG_(printf)("    --count-instrs=no|yes      record per-thread instruction count of writes [no]\n");
+    VG_(printf)("    --false-sharing=no|yes     report cache lines of tracked regions written\n"
+		"                               by different threads to disjoint bytes, captures\n"
+		"                               a stack for every write, even when sampled [no]\n");
+    VG_(printf)("    --false-sharing-window=<n> max logical time between such writes [1000]\n");
+    VG_(printf)("    --summary=history|heatmap  keep last writes of each word, or only count\n"
+		"                               writes per word and stack [history]\n");
+    VG_(printf)("    --heatmap-words=no|yes     also print write count of each word [no]\n");
+    VG_(printf)("    --sample-rate=<n>          record one in <n> writes to tracked regions [1]\n");
+    VG_(printf)("    --track-alloc=<pattern>    track heap blocks allocated with a function\n"
+		"                               matching <pattern> on the stack [none]\n");
+    VG_(printf)("    --track-alloc-size=<n>[-<m>]  track heap blocks of <n> (to <m>) bytes [none]\n");
+    VG_(printf)("    --track-alloc-history=<n>  history of heap blocks tracked by the above,\n"
+		"                               0 for heatmap [4]\n");
+    VG_(printf)("    (malloc and friends are always replaced by Valgrind's allocator)\n");
 }
 
 static void mh_print_debug_usage(void)
@@ -125,13 +210,7 @@ static Bool fit_in_ubytes(ULong v, Int nbytes)
  */
 
 #define MAX_DSIZE    512
-
-
-struct mh_mem_access_t {
-    ExeContext* call_stack;
-    unsigned time_stamp;
-    HWord data;
-};
+#define MAX_STORE_DATA 32  /* V256 */
 
 
 static const char* prot_txt(enum mh_track_type flags)
@@ -143,6 +222,30 @@ static const char* prot_txt(enum mh_track_type flags)
     return txt[(flags & 7) - 1];
 }
 
+/* History of HIST_CHUNK_WORDS consecutive words of a tracked region.
+   Allocated on first write to any of its words. */
+#define HIST_CHUNK_WORDS 256
+
+struct mh_hist_chunk_t {
+    /* History matrix as separate arrays of history*nwords entries,
+       indexed as [hix * nwords + wix]. Each history row thus mirrors
+       the memory layout of the chunk and words written together
+       with equal hist_ix_vec can be updated as one contiguous run. */
+    UInt* ecu;     /* ExeContext unique ids, 0 if not written */
+    ULong* time;   /* time stamps */
+    ULong* icount; /* instruction count of writing thread, or NULL */
+    UShort* tid;   /* writing thread */
+    void* data;    /* data_sz bytes each */
+    unsigned hist_ix_vec[0];
+};
+
+/* Which threads' writes are recorded in a tracked region */
+enum mh_thread_filter {
+    MH_THREADS_ALL = VG_TRACK_ALL_THREADS,
+    MH_THREADS_NOT_OWNER = VG_TRACK_NOT_OWNER,
+    MH_THREADS_SET = VG_TRACK_THREAD
+};
+
 struct mh_region_t {
     rb_tree_node node;
     Addr start;
@@ -150,15 +253,24 @@ struct mh_region_t {
     Addr subtree_min;
     Addr subtree_max;
     const char* name;
-    unsigned birth_time_stamp;
-    unsigned readonly_time_stamp;
+    ULong    birth_time_stamp;
+    ULong    readonly_time_stamp;
     Bool     enabled;
     enum mh_track_type type;
     unsigned word_sz;  /* in bytes */
+    unsigned data_sz;  /* bytes of data saved per word, word_sz or 0 */
     unsigned nwords;   /* #columns */
     unsigned history;  /* #rows */
-    struct mh_mem_access_t* access_matrix;
-    unsigned hist_ix_vec[0];
+    enum mh_thread_filter thread_filter;
+    ThreadId owner;    /* for MH_THREADS_NOT_OWNER */
+    UChar* threads;    /* bitmap for MH_THREADS_SET */
+    struct mh_heatmap_t* heatmap;   /* NULL unless in heatmap mode */
+    Bool changes_only;  /* skip stores that do not change tracked bytes */
+    UInt sample_rate;   /* record one in sample_rate writes */
+    UInt* sample_countdown;  /* per thread, NULL until sampled */
+    ULong writes;       /* all writes, recorded or not by sampling */
+    unsigned nchunks;
+    struct mh_hist_chunk_t* chunk_dir[0];  /* NULL if not yet written */
 };
 
 /*
@@ -188,7 +300,7 @@ static int region_cmp(rb_tree_node* a_node, rb_tree_node* b_node)
 static int update_subtree(rb_tree* tree, rb_tree_node* node, int do_update)
 {
     struct mh_region_t* x = (struct mh_region_t*) node;
-    rb_tree_node* nil = &tree->nil;
+    rb_tree_node* nil = tree->nil;
     Addr new_min = x->subtree_min;
     Addr new_max = x->subtree_max;
 
@@ -237,18 +349,301 @@ static void region_print(rb_tree_node* a_node, int depth)
 
 static struct rb_tree region_tree;
 
+/* Lowest start and highest end of all regions in region_tree.
+   Read by the inline range test that guards every track call,
+   see emit_range_guard(). An empty tree has min > max
+   which makes the test fail for all addresses.
+ */
+static Addr mh_tree_min = ~(Addr)0;
+static Addr mh_tree_max = 0;
+
+static void tree_bounds_updated(void)
+{
+    rb_tree_node* root = region_tree.root.left;
+
+    if (root != region_tree.nil) {
+	mh_tree_min = ((struct mh_region_t*)root)->subtree_min;
+	mh_tree_max = ((struct mh_region_t*)root)->subtree_max;
+    }
+    else {
+	mh_tree_min = ~(Addr)0;
+	mh_tree_max = 0;
+    }
+}
+
+/*
+ * Lazy instrumentation:
+ *
+ * No code is instrumented until the first region is created. All
+ * translations are then discarded to get them redone with instrumentation.
+ * With --discard-when-empty=yes the same is done when the last region
+ * is removed. With --count-instrs=yes all code is instrumented from start.
+ */
+
+static Bool mh_instrumenting = False;
+
+/* Not in pub_tool_*.h, see callgrind */
+extern void VG_(discard_translations) ( Addr64 start, ULong range, const HChar* who );
+
+static void instrumentation_update(void)
+{
+    Bool empty = (region_tree.root.left == region_tree.nil);
+
+    if (empty != mh_instrumenting)
+	return;
+    if (empty && (!clo_discard_when_empty || clo_count_instrs))
+	return;
+
+    mh_instrumenting = !empty;
+    if (clo_trace_mem) {
+	VG_(umsg)("TRACE: Instrumentation %s\n",
+		  mh_instrumenting ? "on" : "off");
+    }
+    VG_(discard_translations)((Addr64)0x1000, (ULong) ~0xfffl, "memhist");
+}
+
+/*
+ * Page map:
+ *
+ * One bit per page, set if any region overlaps the page or the page after.
+ * An access of at most one page in size can then only hit a region if the
+ * bit of the page where it starts is set. The map is two-level in the
+ * style of memcheck's primary_map. All entries of the primary map point
+ * to the distinguished all-zero secondary map until a bit is set.
+ * Addresses above the primary map are folded into its last secondary map,
+ * which bits are never cleared.
+ */
+
+#define PM_PAGE_BITS  12
+#define PM_SEC_BITS   16   /* log2 of #pages per secondary map */
+#if VG_WORDSIZE == 8
+#  define PM_PRIMARY_BITS 20
+#else
+#  define PM_PRIMARY_BITS (32 - PM_PAGE_BITS - PM_SEC_BITS)
+#endif
+
+#define PM_PAGE_SZ       (1UL << PM_PAGE_BITS)
+#define PM_SEC_PAGES     (1UL << PM_SEC_BITS)
+#define PM_PRIMARY_SIZE  (1UL << PM_PRIMARY_BITS)
+#define PM_WORD_BITS     (8 * sizeof(UWord))
+
+typedef struct {
+    UWord bits[PM_SEC_PAGES / PM_WORD_BITS];
+} PageSecMap;
+
+static PageSecMap  pm_distinguished;
+static PageSecMap* pm_primary_map[PM_PRIMARY_SIZE];
+
+static struct mh_region_t* region_lookup_min_overlap(Addr start, Addr end);
+static struct mh_region_t* region_succ(struct mh_region_t* rp);
+
+static void pm_init(void)
+{
+    UWord i;
+
+    tl_assert(MAX_DSIZE <= PM_PAGE_SZ);
+    for (i = 0; i < PM_PRIMARY_SIZE; i++)
+	pm_primary_map[i] = &pm_distinguished;
+}
+
+/* Set or clear bits for pages p0 to p1 (inclusive) */
+static void pm_set_bits(UWord p0, UWord p1, Bool value)
+{
+    while (p0 <= p1) {
+	UWord ix = p0 >> PM_SEC_BITS;
+	UWord b0 = p0 & (PM_SEC_PAGES - 1);
+	UWord b1;
+	PageSecMap* sm;
+
+	if (ix >= PM_PRIMARY_SIZE - 1) {
+	    /* Last secondary map is shared by all high addresses */
+	    ix = PM_PRIMARY_SIZE - 1;
+	    if (!value) return;
+	    b0 = 0;
+	    b1 = PM_SEC_PAGES - 1;
+	}
+	else if ((p1 >> PM_SEC_BITS) > ix)
+	    b1 = PM_SEC_PAGES - 1;
+	else
+	    b1 = p1 & (PM_SEC_PAGES - 1);
+
+	sm = pm_primary_map[ix];
+	if (sm == &pm_distinguished) {
+	    if (!value) goto next;
+	    sm = VG_(malloc)("pm_set_bits", sizeof(PageSecMap));
+	    VG_(memset)(sm, 0, sizeof(PageSecMap));
+	    pm_primary_map[ix] = sm;
+	}
+
+	while (b0 <= b1) {
+	    UWord wix = b0 / PM_WORD_BITS;
+	    UWord lo = b0 % PM_WORD_BITS;
+	    UWord hi = (b1 / PM_WORD_BITS > wix) ? PM_WORD_BITS - 1
+						 : b1 % PM_WORD_BITS;
+	    UWord mask = (~(UWord)0 >> (PM_WORD_BITS - 1 - hi)) & (~(UWord)0 << lo);
+
+	    if (value)
+		sm->bits[wix] |= mask;
+	    else
+		sm->bits[wix] &= ~mask;
+	    b0 += hi - lo + 1;
+	}
+    next:
+	if (ix == PM_PRIMARY_SIZE - 1)
+	    return;
+	p0 = (ix + 1) << PM_SEC_BITS;
+    }
+}
+
+/* Set bits for all pages where an access may hit [start,end) */
+static void pm_mark(Addr start, Addr end)
+{
+    UWord p0 = start >> PM_PAGE_BITS;
+    UWord p1 = (end - 1) >> PM_PAGE_BITS;
+
+    if (p0 > 0) p0--;
+    pm_set_bits(p0, p1, True);
+}
+
+/* [start,end) is no longer (fully) covered by regions.
+   Clear its bits and set them again for any remaining neighbours. */
+static void pm_unmark(Addr start, Addr end)
+{
+    UWord p0 = start >> PM_PAGE_BITS;
+    UWord p1 = (end - 1) >> PM_PAGE_BITS;
+    Addr lo, hi;
+    struct mh_region_t* rp;
+
+    if (p0 > 0) p0--;
+    pm_set_bits(p0, p1, False);
+
+    lo = p0 << PM_PAGE_BITS;
+    hi = (p1 + 2) << PM_PAGE_BITS;
+    if (hi < lo) hi = ~(Addr)0;
+    for (rp = region_lookup_min_overlap(lo, hi);
+	 rp && rp->start < hi;
+	 rp = region_succ(rp)) {
+	pm_mark(MAX(rp->start, lo), MIN(rp->end, hi));
+    }
+}
+
+/* Bumped on every change to the set of regions or their extents.
+   Invalidates all site caches (see struct mh_site_cache_t). */
+static UWord mh_region_gen = 1;
+
+/* Number of regions in region_tree */
+static UWord mh_region_count = 0;
+
+/* Regions without history, i.e protection-only regions, all have the
+   same size and are created and freed constantly as protection is set,
+   cleared, split and merged. They come from a pool. */
+static PoolAlloc* region_pool = NULL;
+
+static struct mh_region_t* region_alloc(unsigned nchunks)
+{
+    struct mh_region_t* rp;
+
+    if (nchunks) {
+	rp = VG_(malloc)("mh.region",
+			 sizeof(struct mh_region_t) + nchunks * sizeof(*rp->chunk_dir));
+    }
+    else {
+	if (!region_pool)
+	    region_pool = VG_(newPA)(sizeof(struct mh_region_t), 1000,
+				     VG_(malloc), "mh.region_pool", VG_(free));
+	rp = VG_(allocEltPA)(region_pool);
+    }
+    rp->nchunks = nchunks;
+    return rp;
+}
+
+static void region_free(struct mh_region_t* rp)
+{
+    if (rp->nchunks)
+	VG_(free)(rp);
+    else
+	VG_(freeEltPA)(region_pool, rp);
+}
+
 static
 struct mh_region_t* region_insert(struct mh_region_t* rp)
 {
+    struct mh_region_t* clash;
+
     rp->subtree_min = rp->start;
     rp->subtree_max = rp->end;
-    return (struct mh_region_t*)rb_tree_insert(&region_tree,
-					       &rp->node);
+    clash = (struct mh_region_t*)rb_tree_insert(&region_tree,
+						&rp->node);
+    if (!clash) {
+	pm_mark(rp->start, rp->end);
+	instrumentation_update();
+	++mh_region_gen;
+	++mh_region_count;
+    }
+    tree_bounds_updated();
+    return clash;
 }
 
 static void region_remove(struct mh_region_t* rp)
 {
     rb_tree_remove(&region_tree, &rp->node);
+    pm_unmark(rp->start, rp->end);
+    instrumentation_update();
+    ++mh_region_gen;
+    --mh_region_count;
+    tree_bounds_updated();
+}
+
+/* Insert 'n' regions sorted by start into an address range without
+   regions. The tree is split at the range and the regions are joined in
+   as a tree of their own, in O(log N + n) instead of O(n log N). */
+static void region_insert_sorted(struct mh_region_t** rps, UWord n)
+{
+    rb_tree mid, right;
+    UWord i;
+
+    rb_tree_split(&region_tree, (void*)rps[0]->start, &right);
+    rb_tree_init_from(&mid, &region_tree);
+    rb_tree_build_sorted(&mid, (rb_tree_node**)rps, n);
+    rb_tree_join(&region_tree, &mid);
+    rb_tree_join(&region_tree, &right);
+
+    for (i = 0; i < n; i++)
+	pm_mark(rps[i]->start, rps[i]->end);
+    instrumentation_update();
+    ++mh_region_gen;
+    mh_region_count += n;
+    tree_bounds_updated();
+}
+
+/* Free all regions in sub-tree, return their number */
+static UWord region_free_subtree(rb_tree* tree, rb_tree_node* x)
+{
+    UWord n = 0;
+
+    if (x != tree->nil) {
+	n = 1 + region_free_subtree(tree, x->left)
+	      + region_free_subtree(tree, x->right);
+	region_free((struct mh_region_t*)x);
+    }
+    return n;
+}
+
+/* Remove and free all regions in [start,end), none of which may extend
+   outside it, by splitting them out of the tree. */
+static void region_remove_all(Addr start, Addr end)
+{
+    rb_tree mid, right;
+
+    rb_tree_split(&region_tree, (void*)start, &mid);
+    rb_tree_split(&mid, (void*)end, &right);
+    rb_tree_join(&region_tree, &right);
+    mh_region_count -= region_free_subtree(&mid, mid.root.left);
+
+    pm_unmark(start, end);
+    instrumentation_update();
+    ++mh_region_gen;
+    tree_bounds_updated();
 }
 
 static
@@ -294,7 +689,7 @@ static
 struct mh_region_t* region_lookup_min_overlap(Addr start, Addr end)
 {
     struct mh_region_t* x = (struct mh_region_t*) region_tree.root.left;
-    struct mh_region_t* nil = (struct mh_region_t*) &region_tree.nil;
+    struct mh_region_t* nil = (struct mh_region_t*) region_tree.nil;
     struct mh_region_t* min_overlap = NULL;
 #ifdef MH_DEBUG
     int done = 0;
@@ -352,793 +747,3267 @@ static void insert_nonoverlapping(struct mh_region_t* rp)
     tl_assert(!(clash = region_succ(rp)) || clash->start >= rp->end);
 }
 
-static void node_updated(struct mh_region_t* rp)
+/* Move start and/or end of a region that is in the tree */
+static void region_resize(struct mh_region_t* rp, Addr start, Addr end)
 {
-    rb_tree_node_updated(&region_tree, &rp->node);
-}
+    Addr old_start = rp->start;
+    Addr old_end = rp->end;
 
+    rp->start = start;
+    rp->end = end;
+    rb_tree_node_updated(&region_tree, &rp->node);
 
-/* ---------------------------------------------------------------------
- * Runtime "helper" functions called for every data load, data store
- * or instruction fetch.
- * --------------------------------------------------------------------- */
+    if (start > old_start)
+	pm_unmark(old_start, MIN(start, old_end));
+    if (end < old_end)
+	pm_unmark(MAX(end, old_start), old_end);
+    pm_mark(start, end);
+    ++mh_region_gen;
+    tree_bounds_updated();
+}
 
-static unsigned mh_logical_time = 0;
+/*
+ * Lookup index:
+ *
+ * Region ends, and the regions, in Eytzinger (breadth first) order.
+ * The top levels of the implicit tree share a few cache lines that stay
+ * hot, and the keys a full cache line of descendants ahead are
+ * prefetched, so a search does not wait on one scattered tree node per
+ * level. The index is valid as long as ix_gen equals
+ * mh_region_gen. It is rebuilt from the tree once as many lookups as
+ * there are regions have been done since the last change, so the
+ * rebuild is paid for by lookups and a region set under constant change
+ * is served by the tree as before.
+ */
 
-static void report_store_in_block(struct mh_region_t* rp,
-				  Addr addr, SizeT size, Addr64 data)
+#define IX_LINE_KEYS  (64 / sizeof(Addr))
+#define IX_MIN_STALE  64   /* lookups before first rebuild */
+
+static Addr* ix_end = NULL;  /* ix_end[1..ix_n], cache line aligned */
+static struct mh_region_t** ix_region = NULL;
+static void* ix_mem = NULL;
+static UWord ix_n = 0;
+static UWord ix_cap = 0;
+static UWord ix_gen = 0;
+static UWord ix_stale_gen = 0;
+static UWord ix_stale_lookups = 0;
+static ULong stat_ix_builds = 0;
+
+/* Fill sub-tree 'k' in order from the region list starting at *rpp */
+static void ix_fill(UWord k, struct mh_region_t** rpp)
 {
-    ThreadId tid = VG_(get_running_tid)();  // Should tid be passed as arg instead?
-    ExeContext* ec = VG_(record_ExeContext)(tid, 0);
-    unsigned wix; /* word index */
-    unsigned start_wix, end_wix;
-    Addr start = addr;
-    Addr end = addr + size;
+    if (k > ix_n)
+	return;
+    ix_fill(2 * k, rpp);
+    ix_end[k] = (*rpp)->end;
+    ix_region[k] = *rpp;
+    *rpp = region_succ(*rpp);
+    ix_fill(2 * k + 1, rpp);
+}
 
-    if (start < rp->start) {
-	union {
-	    Addr64 words[2];
-	    char bytes[2 * 8];
-	}u;
-	int offs = rp->start - start;
-	u.words[0] = data;
-	u.words[1] = 0;
-	tl_assert(offs < 8);
-	data = *(Addr64*)&u.bytes[offs];    /* BUG: Unaligned word access */
-	start = rp->start;
-    }
-    if (end > rp->end) end = rp->end;
-
-    start_wix = (start - rp->start) / rp->word_sz;
-    end_wix = (end - rp->start - 1) / rp->word_sz + 1;
-    tl_assert(start_wix < end_wix);
-    tl_assert(end_wix <= rp->nwords);
+static void ix_build(void)
+{
+    struct mh_region_t* rp;
 
-    if (clo_trace_mem) {
-	VG_(umsg)("TRACE: %u bytes written at addr %p at time %u:\n",
-		  (unsigned)size, (void*)addr, mh_logical_time);
-	VG_(pp_ExeContext)(ec);
+    ix_n = mh_region_count;
+    if (ix_n + 1 > ix_cap) {
+	if (ix_mem) VG_(free)(ix_mem);
+	ix_cap = 2 * (ix_n + 1);
+	ix_mem = VG_(malloc)("mh.lookup_index",
+			     ix_cap * (sizeof(Addr) + sizeof(*ix_region)) + 64);
+	ix_end = (Addr*)(((Addr)ix_mem + 63) & ~(Addr)63);
+	ix_region = (struct mh_region_t**)(ix_end + ix_cap);
     }
+    rp = region_min();
+    ix_fill(1, &rp);
+    tl_assert(!rp);
+    ix_gen = mh_region_gen;
+    stat_ix_builds++;
+}
 
-    for (wix = start_wix; wix < end_wix; wix++) {
-	int i;
-	unsigned hix = rp->hist_ix_vec[wix]++;
-
-	if (rp->hist_ix_vec[wix] >= rp->history) rp->hist_ix_vec[wix] = 0;
+/* Same as region_lookup_min_overlap(), using the index when possible */
+static struct mh_region_t* region_lookup_access(Addr start, Addr end)
+{
+    struct mh_region_t* rp;
+    UWord k;
 
-	i = (rp->history * wix) + hix;
-	//VG_(umsg)("TRACE: Saving at wix=%u hix=%u -> i=%u\n", wix, hix, i);
-	rp->access_matrix[i].call_stack = ec;
-	rp->access_matrix[i].time_stamp = mh_logical_time;
-	rp->access_matrix[i].data = data;
+    if (ix_gen != mh_region_gen) {
+	if (ix_stale_gen != mh_region_gen) {
+	    ix_stale_gen = mh_region_gen;
+	    ix_stale_lookups = 0;
+	}
+	if (++ix_stale_lookups < mh_region_count + IX_MIN_STALE)
+	    return region_lookup_min_overlap(start, end);
+	ix_build();
+    }
 
-	start += rp->word_sz;
+    /* Regions do not overlap so ends are sorted as starts are.
+       Find the first region that ends after 'start'. */
+    k = 1;
+    while (k <= ix_n) {
+	__builtin_prefetch(ix_end + k * IX_LINE_KEYS);
+	k = 2 * k + (ix_end[k] <= start);
     }
+    k >>= __builtin_ffsl(~k);
+    rp = (k && ix_region[k]->start < end) ? ix_region[k] : NULL;
+    MH_ASSERT(rp == region_lookup_min_overlap(start, end));
+    return rp;
 }
 
-static unsigned protection_disable_counter = 0;
-
-static Int track_mem_access(Addr addr, SizeT size, Long data,
-			    enum mh_track_type type)
-{
-    Addr start = addr;
-    Addr end = addr + size;
-    struct mh_region_t* rp = region_lookup_min_overlap(addr, end);
-    Bool got_a_hit = 0;
 
-    if (!rp) return 0;
-
-    do {
-	tl_assert(end > rp->start && start < rp->end);
+/* ---------------------------------------------------------------------
+ * Runtime "helper" functions called for every data load, data store
+ * or instruction fetch.
+ * --------------------------------------------------------------------- */
 
-	if (rp->enabled) {
-	    switch (type) {
-	    case MH_WRITE:
-		if ((rp->type & MH_WRITE) && !protection_disable_counter) {
-		    VG_(umsg)("Provoking SEGV: %u bytes WRITTEN to protected "
-			      "region '%s' at addr %p at time %u:\n",
-			      (unsigned)size, rp->name, (void*)addr,
-			      mh_logical_time);
-		    return 1; /* Crash! */
-		}
-		if (rp->type & MH_TRACK) {
-		    report_store_in_block(rp, addr, size, data);
-		}
-		break;
+static ULong mh_logical_time = 0;
 
-	    case MH_READ:
-		if ((rp->type & MH_READ) && !protection_disable_counter) {
-		    VG_(umsg)("Provoking SEGV: %u bytes READ from protected "
-			      "region '%s' at addr %p at time %u:\n",
-			      (unsigned)size, rp->name, (void*)addr,
-			      mh_logical_time);
-		    return 1; /* Crash! */
-		}
-		break;
+/*
+ * Guest instruction count of the running thread, with --count-instrs.
+ * Incremented by instrumented code and swapped with the per-thread slot
+ * when another thread starts running, so each thread has its own count.
+ */
+static ULong mh_instr_count = 0;
+static ULong mh_thread_instr_count[VG_N_THREADS];
+static ThreadId mh_instr_count_tid = VG_INVALID_THREADID;
 
-	    case MH_EXE:
-		if ((rp->type & MH_EXE) && !protection_disable_counter) {
-		    VG_(umsg)("Provoking SEGV: %u-byte instruction executed in protected "
-			      "region '%s' at addr %p at time %u:\n",
-			      (unsigned)size, rp->name, (void*)addr,
-			      mh_logical_time);
-		    return 1; /* Crash! */
-		}
-		break;
+static void mh_start_client_code(ThreadId tid, ULong bbs_done)
+{
+    if (tid != mh_instr_count_tid) {
+	if (mh_instr_count_tid != VG_INVALID_THREADID)
+	    mh_thread_instr_count[mh_instr_count_tid] = mh_instr_count;
+	mh_instr_count = mh_thread_instr_count[tid];
+	mh_instr_count_tid = tid;
+    }
+}
 
-	    default:
-		tl_assert2(0, "Invalid mem access type %x", type);
-	    }
-	    got_a_hit = 1;
-	}
-	if (end <= rp->end) break;
+/*
+ * Call stacks of history records.
+ *
+ * A history slot holds a 32-bit stack id. It is either an ExeContext
+ * unique id (always a multiple of 4) or, with --history-stack=lazy,
+ * a reference to a lazy stack tagged with LAZY_STACK_TAG in the low
+ * bits. Lazy stacks are raw IP arrays, reference counted by the slots
+ * that hold them, and interned into an ExeContext when first reported.
+ */
+#define LAZY_STACK_TAG   1
 
-	rp = region_succ(rp);
-    }while (rp && end > rp->start);
+struct mh_lazy_stack_t {
+    UInt refs;   /* #slots (and threads) referring to it, next free if unused */
+    UInt ecu;    /* 0 until interned */
+    UInt n_ips;
+};
 
-    if (got_a_hit) ++mh_logical_time;
+static struct mh_lazy_stack_t* lazy_stacks = NULL;
+static UInt lazy_stacks_size = 0;
+static UInt lazy_stacks_free = 0;    /* head of free list, 0 if empty */
 
-    return 0; /* Ok */
-}
+/* IPs of lazy stack i at lazy_ips[i * lazy_depth], lazy_depth being
+   --num-callers as for full stacks. Captured into lazy_scratch. */
+static Addr* lazy_ips = NULL;
+static Addr* lazy_scratch = NULL;
+static UInt lazy_depth = 0;
 
-#define track_REGPARM 2
+/* Last lazy stack captured per thread, to share it between consecutive
+   stores from the same place */
+static UInt lazy_last[VG_N_THREADS];
 
-VG_REGPARM(track_REGPARM)
-static Int track_store(Addr addr, SizeT size, Long data)
+static Bool is_lazy_stack(UInt id)
 {
-    return track_mem_access(addr, size, data, MH_WRITE);
+    return (id & 3) == LAZY_STACK_TAG;
 }
 
-VG_REGPARM(track_REGPARM)
-static Int track_load(Addr addr, SizeT size)
+static struct mh_lazy_stack_t* lazy_stack(UInt id)
 {
-    return track_mem_access(addr, size, 0, MH_READ);
+    tl_assert(is_lazy_stack(id) && (id >> 2) < lazy_stacks_size);
+    return &lazy_stacks[id >> 2];
 }
 
-VG_REGPARM(track_REGPARM)
-static Int track_exe(Addr addr, SizeT size)
+static Addr* lazy_stack_ips(UInt id)
 {
-    return track_mem_access(addr, size, 0, MH_EXE);
+    return &lazy_ips[(id >> 2) * lazy_depth];
 }
 
-VG_REGPARM(track_REGPARM)
-static Int track_cas(Addr addr, SizeT size, ULong expected, ULong data)
+static UInt lazy_stack_alloc(void)
 {
-    ULong actual;
-    MH_ASSERT2(fit_in_ubytes(expected, size), " expected=%llx size=%u", expected, (int)size);
-    MH_ASSERT2(fit_in_ubytes(data, size), " data=%llx size=%u", data, (int)size);
-    switch (size) {
-    case 1: actual = *(UChar*)addr;  break;
-    case 2: actual = *(UShort*)addr; break;
-    case 4: actual = *(UInt*)addr;   break;
-    case 8: actual = *(ULong*)addr;  break;
-    default:
-	tl_assert2(0, "CAS on %u-words not implemented", size);
+    UInt ix;
+
+    if (!lazy_stacks_free) {
+	UInt old_size = lazy_stacks_size;
+	UInt i;
+
+	/* Entry 0 is never used, so that ids are never 0 */
+	lazy_stacks_size = old_size ? old_size * 2 : 1024;
+	lazy_stacks = VG_(realloc)("mh.lazy_stacks", lazy_stacks,
+				   lazy_stacks_size * sizeof(*lazy_stacks));
+	lazy_ips = VG_(realloc)("mh.lazy_ips", lazy_ips,
+				lazy_stacks_size * lazy_depth * sizeof(Addr));
+	for (i = lazy_stacks_size - 1; i >= old_size && i > 0; i--) {
+	    lazy_stacks[i].refs = lazy_stacks_free;
+	    lazy_stacks_free = i;
+	}
     }
-    return (actual == expected) ? track_store(addr, size, data) : 0;
+    ix = lazy_stacks_free;
+    lazy_stacks_free = lazy_stacks[ix].refs;
+    lazy_stacks[ix].refs = 0;
+    lazy_stacks[ix].ecu = 0;
+    return (ix << 2) | LAZY_STACK_TAG;
 }
 
+static void stack_release(UInt id, UInt n)
+{
+    struct mh_lazy_stack_t* sp;
 
+    if (!is_lazy_stack(id))
+	return;
+    sp = lazy_stack(id);
+    tl_assert(sp->refs >= n);
+    sp->refs -= n;
+    if (!sp->refs) {
+	sp->refs = lazy_stacks_free;
+	lazy_stacks_free = id >> 2;
+    }
+}
 
-#if VEX_HOST_WORDSIZE == 4
-    #define IRConst_HWord IRConst_U32
-#elif VEX_HOST_WORDSIZE == 8
-    #define IRConst_HWord IRConst_U64
-#else
-    #error "VEX_HOST_WORDSIZE not set to 4 or 8"
-#endif
+static void stack_retain(UInt id, UInt n)
+{
+    if (is_lazy_stack(id))
+	lazy_stack(id)->refs += n;
+}
 
+static UInt lazy_stack_capture(ThreadId tid)
+{
+    UInt n_ips;
+    UInt id = lazy_last[tid];
+    struct mh_lazy_stack_t* sp;
+
+    if (!lazy_scratch) {
+	lazy_depth = VG_(clo_backtrace_size);
+	lazy_scratch = VG_(malloc)("mh.lazy_scratch",
+				   lazy_depth * sizeof(Addr));
+    }
+    n_ips = VG_(get_StackTrace)(tid, lazy_scratch, lazy_depth,
+				NULL, NULL, 0);
+    if (id) {
+	sp = lazy_stack(id);
+	if (sp->n_ips == n_ips
+	    && !VG_(memcmp)(lazy_stack_ips(id), lazy_scratch,
+			    n_ips * sizeof(Addr)))
+	    return id;
+	stack_release(id, 1);
+    }
+    id = lazy_stack_alloc();
+    sp = lazy_stack(id);
+    sp->refs = 1;   /* lazy_last */
+    sp->n_ips = n_ips;
+    VG_(memcpy)(lazy_stack_ips(id), lazy_scratch, n_ips * sizeof(Addr));
+    lazy_last[tid] = id;
+    return id;
+}
 
-static IRType size2itype(int size)
+/* Get stack id for a write by thread 'tid' now. Lazy stacks are not
+   retained by the call, see stack_retain. The ExeContext, if any,
+   is returned in *ecp. */
+static UInt stack_capture(ThreadId tid, ExeContext** ecp)
 {
-    IRType type;
-    switch (size) {
-    case 1: type = Ity_I8;   break;
-    case 2: type = Ity_I16;  break;
-    case 4: type = Ity_I32;  break;
-    case 8: type = Ity_I64;  break;
-    case 16: type = Ity_I128; break;
+    ExeContext* ec;
+
+    switch (clo_history_stack) {
+    case MH_STACK_LAZY:
+	*ecp = NULL;
+	return lazy_stack_capture(tid);
+    case MH_STACK_IP:
+	ec = VG_(record_depth_1_ExeContext)(tid, 0);
+	break;
     default:
-	tl_assert2(0, "Invalid integer size %u", size);
+	ec = VG_(record_ExeContext)(tid, 0);
+	break;
     }
-    return type;
+    *ecp = ec;
+    return VG_(get_ECU_from_ExeContext)(ec);
 }
 
+/* VG_(get_ExeContext_from_ECU) does a linear search of all contexts,
+   so remember recent translations. */
+#define ECU_CACHE_SIZE 1024
 
-static IRExpr* expr2atom(IRSB* sb, IRExpr* e)
+static ExeContext* stack_to_exe_context(UInt id)
 {
-    if (!isIRAtom(e)) {
-	Int size = sizeofIRType(typeOfIRExpr(sb->tyenv, e));
-	IRTemp tmp = newIRTemp(sb->tyenv, size2itype(size));
-	addStmtToIRSB(sb, IRStmt_WrTmp(tmp, e));
-	e = IRExpr_RdTmp(tmp);
+    static struct {
+	UInt ecu;
+	ExeContext* ec;
+    } cache[ECU_CACHE_SIZE];
+    unsigned ix;
+
+    if (is_lazy_stack(id)) {
+	struct mh_lazy_stack_t* sp = lazy_stack(id);
+	if (!sp->ecu) {
+	    ExeContext* ec = VG_(make_ExeContext_from_StackTrace)(
+		lazy_stack_ips(id), sp->n_ips);
+	    sp->ecu = VG_(get_ECU_from_ExeContext)(ec);
+	    ix = (sp->ecu / 4) % ECU_CACHE_SIZE;
+	    cache[ix].ecu = sp->ecu;
+	    cache[ix].ec = ec;
+	    return ec;
+	}
+	id = sp->ecu;
     }
-    return e;
+
+    ix = (id / 4) % ECU_CACHE_SIZE;
+    if (cache[ix].ecu != id) {
+	cache[ix].ec = VG_(get_ExeContext_from_ECU)(id);
+	cache[ix].ecu = id;
+	tl_assert(cache[ix].ec);
+    }
+    return cache[ix].ec;
 }
 
-static IRExpr*
-widen_to_U64(IRSB* sb, IRExpr* iexpr)
+static unsigned align_up(unsigned unit, unsigned value)
 {
-    Int size = sizeofIRType(typeOfIRExpr(sb->tyenv, iexpr));
-    switch (size) {
-    case 1: return IRExpr_Unop(Iop_8Uto64, iexpr);
-    case 2: return IRExpr_Unop(Iop_16Uto64, iexpr);
-    case 4: return IRExpr_Unop(Iop_32Uto64, iexpr);
-    case 8: return iexpr;
-    }
-    return NULL;
+    return ((value + unit - 1) / unit) * unit;
 }
 
-static void emit_track_call(IRSB* sb, HWord ip,
-			    void* fn, const char* fn_name, IRExpr** argv)
+/* Statistics for monitor command 'stats' */
+static ULong stat_hist_chunks = 0;
+static ULong stat_hist_bytes = 0;
+static ULong stat_stores = 0;
+static ULong stat_silent_stores = 0;
+
+static unsigned hist_chunk_nwords(struct mh_region_t* rp, unsigned cix)
 {
-    IRExpr* cond_ex;
-    IRTemp cond_tmp;
-    IRTemp retval_tmp = newIRTemp(sb->tyenv, Ity_I32);
-    IRDirty* di = unsafeIRDirty_1_N(retval_tmp,
-				    track_REGPARM,
-				    fn_name,
-				    VG_(fnptr_to_fnentry)(fn),
-				    argv);
-    addStmtToIRSB(sb, IRStmt_Dirty(di));
-    cond_ex = IRExpr_Unop(Iop_32to1, IRExpr_RdTmp(retval_tmp));
-    cond_tmp = newIRTemp(sb->tyenv, Ity_I1);
-    addStmtToIRSB(sb, IRStmt_WrTmp(cond_tmp, cond_ex));
-    addStmtToIRSB(sb, IRStmt_Exit(IRExpr_RdTmp(cond_tmp), Ijk_SigSEGV,
-				  IRConst_HWord(ip), sb->offsIP));
+    return MIN(HIST_CHUNK_WORDS, rp->nwords - cix * HIST_CHUNK_WORDS);
 }
 
-static
-void addEvent_Dw(IRSB* sb, IRExpr* daddr, Int dsize,
-		 IRExpr* expected, /* if CAS */
-		 IRExpr* data, HWord ip)
-{
-    IRExpr**   argv;
-    IRExpr*    data64 = NULL;
-    IRExpr*    expd64;
+/* History chunks up to 4 KiB, typical of small regions or short history,
+   come from one pool per size class with four classes per power of two.
+   Chunks freed by untrack are then reused as is. Pools hold at least
+   100 elements, so larger chunks use VG_(malloc). */
+#define HIST_MIN_CLASS_BITS 6
+#define HIST_MAX_CLASS_BITS 12
+#define HIST_NCLASSES ((HIST_MAX_CLASS_BITS - HIST_MIN_CLASS_BITS) * 4 + 1)
 
-    tl_assert(isIRAtom(daddr));
-    tl_assert(dsize >= 1 && dsize <= MAX_DSIZE);
+static PoolAlloc* hist_pools[HIST_NCLASSES];
 
-    if (data) {
-	data64 = widen_to_U64(sb, data);
-    }
-    if (!data64) {
-	data64 = IRExpr_Const(IRConst_U64((ULong)0xdead));
-    }
+/* Return size class of 'size' and its element size in *class_sz,
+   or -1 if too large to be pooled. */
+static Int hist_class(SizeT size, SizeT* class_sz)
+{
+    unsigned bits = HIST_MIN_CLASS_BITS;
+    SizeT base, step;
 
-    if (expected) {
-	/*  Emit:
-	 *
-	 *  if (track_cas(daddr, dsize, expd, data))
-	 *      exit(SEGV);
-	 */
-	expd64 = widen_to_U64(sb, expected);
-	tl_assert(expd64 != NULL);
-	argv = mkIRExprVec_4(daddr, mkIRExpr_HWord(dsize),
-			     expr2atom(sb, expd64), expr2atom(sb, data64));
-	emit_track_call(sb, ip, track_cas, "track_cas", argv);
-    }
-    else {
-	/*  Emit:
-	 *
-	 *  if (track_store(daddr, dsize, data))
-	 *      exit(SEGV);
-	 */
-	argv = mkIRExprVec_3(daddr, mkIRExpr_HWord(dsize), expr2atom(sb, data64));
-	emit_track_call(sb, ip, track_store, "track_store", argv);
+    if (size <= (1UL << HIST_MIN_CLASS_BITS)) {
+	*class_sz = 1UL << HIST_MIN_CLASS_BITS;
+	return 0;
     }
+    if (size > (1UL << HIST_MAX_CLASS_BITS))
+	return -1;
+    while ((2UL << bits) < size)
+	bits++;
+    base = 1UL << bits;
+    step = (size - base + base / 4 - 1) / (base / 4);   /* 1..4 */
+    *class_sz = base + step * (base / 4);
+    return (bits - HIST_MIN_CLASS_BITS) * 4 + step;
 }
 
-static void addEvent_Dr(IRSB* sb, IRExpr* daddr, Int dsize, HWord ip)
+static void* hist_chunk_alloc(SizeT size)
 {
-    IRExpr**   argv;
+    SizeT class_sz;
+    Int c = hist_class(size, &class_sz);
+
+    if (c < 0)
+	return VG_(malloc)("mh.hist_chunk", size);
+    if (!hist_pools[c])
+	hist_pools[c] = VG_(newPA)(class_sz, MAX(100, 65536 / class_sz),
+				   VG_(malloc), "mh.hist_pool", VG_(free));
+    return VG_(allocEltPA)(hist_pools[c]);
+}
 
-    tl_assert(isIRAtom(daddr));
-    tl_assert(dsize >= 1 && dsize <= MAX_DSIZE);
+static void hist_chunk_free(void* cp, SizeT size)
+{
+    SizeT class_sz;
+    Int c = hist_class(size, &class_sz);
 
-    /*  Emit:
-     *
-     *  if (track_load(daddr, dsize))
-     *      exit(SEGV);
-     */
-    argv = mkIRExprVec_2(daddr, mkIRExpr_HWord(dsize));
-    emit_track_call(sb, ip, track_load, "track_load", argv);
+    if (c < 0)
+	VG_(free)(cp);
+    else
+	VG_(freeEltPA)(hist_pools[c], cp);
 }
 
-static void addEvent_Ir(IRSB* sb, HWord iaddr, UInt isize)
+/* Get history chunk for word 'wix', allocate it if needed */
+static struct mh_hist_chunk_t* hist_chunk(struct mh_region_t* rp, unsigned wix)
 {
-    IRExpr**   argv;
+    unsigned cix = wix / HIST_CHUNK_WORDS;
+    struct mh_hist_chunk_t* cp = rp->chunk_dir[cix];
+
+    if (!cp) {
+	const unsigned nwords = hist_chunk_nwords(rp, cix);
+	const unsigned nslots = nwords * rp->history;
+	const unsigned ecu_offset = align_up(sizeof(ULong),
+					     (sizeof(struct mh_hist_chunk_t)
+					      + nwords * sizeof(*cp->hist_ix_vec)));
+	const unsigned time_offset = align_up(sizeof(ULong),
+					      ecu_offset + nslots * sizeof(UInt));
+	const unsigned icount_offset = time_offset + nslots * sizeof(ULong);
+	const unsigned tid_offset = icount_offset
+	    + (clo_count_instrs ? nslots * sizeof(ULong) : 0);
+	const unsigned data_offset = align_up(sizeof(ULong),
+					      tid_offset + nslots * sizeof(UShort));
+
+	cp = hist_chunk_alloc(data_offset + nslots * rp->data_sz);
+	stat_hist_chunks++;
+	stat_hist_bytes += data_offset + nslots * rp->data_sz;
+	cp->ecu = (UInt*)((char*)cp + ecu_offset);
+	cp->time = (ULong*)((char*)cp + time_offset);
+	cp->icount = clo_count_instrs ? (ULong*)((char*)cp + icount_offset) : NULL;
+	cp->tid = (UShort*)((char*)cp + tid_offset);
+	cp->data = (char*)cp + data_offset;
+	VG_(memset)(cp->hist_ix_vec, 0, nwords * sizeof(*cp->hist_ix_vec));
+	VG_(memset)(cp->ecu, 0, nslots * sizeof(UInt));
+	rp->chunk_dir[cix] = cp;
+    }
+    return cp;
+}
 
-    tl_assert(isize >= 1 && isize <= MAX_DSIZE);
+static void hist_free(struct mh_region_t* rp)
+{
+    unsigned cix;
 
-    /*  Emit:
-     *
-     *  if (track_exe(iaddr, isize))
-     *      exit(SEGV);
-     */
-    argv = mkIRExprVec_2(mkIRExpr_HWord(iaddr), mkIRExpr_HWord(isize));
-    emit_track_call(sb, iaddr, track_exe, "track_exe", argv);
+    for (cix = 0; cix < rp->nchunks; cix++) {
+	if (rp->chunk_dir[cix]) {
+	    struct mh_hist_chunk_t* cp = rp->chunk_dir[cix];
+	    unsigned i, nslots = hist_chunk_nwords(rp, cix) * rp->history;
+	    SizeT size = ((char*)cp->data - (char*)cp) + nslots * rp->data_sz;
+
+	    for (i = 0; i < nslots; i++) {
+		if (cp->ecu[i])
+		    stack_release(cp->ecu[i], 1);
+	    }
+	    stat_hist_chunks--;
+	    stat_hist_bytes -= size;
+	    hist_chunk_free(cp, size);
+	    rp->chunk_dir[cix] = NULL;
+	}
+    }
 }
 
+static ULong hist_get_data(struct mh_region_t* rp, struct mh_hist_chunk_t* cp,
+			   unsigned i)
+{
+    switch (rp->data_sz) {
+    case 1: return ((UChar*)cp->data)[i];
+    case 2: return ((UShort*)cp->data)[i];
+    case 4: return ((UInt*)cp->data)[i];
+    case 8: return ((ULong*)cp->data)[i];
+    default: return 0;
+    }
+}
 
 /*------------------------------------------------------------*/
-/*--- Basic tool functions                                 ---*/
+/*--- Binary trace file, see mh_trace_format.h             ---*/
 /*------------------------------------------------------------*/
 
-static void mh_post_clo_init(void)
+/* An open trace or dump file */
+struct mh_trace_out {
+    Int fd;                 /* -1 after write error */
+    UChar* buf;             /* raw block being filled */
+    UInt buf_used;
+    UChar* zbuf;            /* compressed block */
+    void* lzo_wrkmem;
+    UChar* stacks_done;     /* bitmap of stacks written, indexed by ECU/4 */
+    UInt stacks_done_size;
+};
+
+/* --trace-file, NULL if not tracing */
+static struct mh_trace_out* trace_out = NULL;
+
+static void trace_write_out(struct mh_trace_out* out, const void* p, UInt len)
 {
+    const UChar* bytes = p;
+
+    while (len > 0 && out->fd >= 0) {
+	Int n = VG_(write)(out->fd, bytes, len);
+	if (n <= 0) {
+	    VG_(umsg)("Error writing trace file, output stopped.\n");
+	    VG_(close)(out->fd);
+	    out->fd = -1;
+	    return;
+	}
+	bytes += n;
+	len -= n;
+    }
 }
 
-static
-IRSB* mh_instrument(VgCallbackClosure* closure,
-		    IRSB* sbIn,
-		    VexGuestLayout* layout,
-		    VexGuestExtents* vge,
-		    VexArchInfo* arch,
-		    IRType gWordTy, IRType hWordTy)
+static void trace_flush(struct mh_trace_out* out)
 {
-    Int        i;
-    IRSB*      sbOut;
-    IRTypeEnv* tyenv = sbIn->tyenv;
-    HWord      currIP = 0;
+    struct mh_trace_block_header bh;
+    SizeT zlen;
 
-    if (gWordTy != hWordTy) {
-	/* We don't currently support this case. */
-	VG_(tool_panic)("host/guest word size mismatch");
+    if (!out->buf_used || out->fd < 0)
+	return;
+
+    zlen = VG_(lzo1x_1_compress)(out->buf, out->buf_used, out->zbuf,
+				 out->lzo_wrkmem);
+
+    bh.magic = MH_TRACE_BLOCK_MAGIC;
+    bh.raw_len = out->buf_used;
+    bh.pad = 0;
+    if (zlen < out->buf_used) {
+	bh.comp_len = zlen;
+	trace_write_out(out, &bh, sizeof(bh));
+	trace_write_out(out, out->zbuf, zlen);
+    }
+    else {
+	bh.comp_len = out->buf_used;
+	trace_write_out(out, &bh, sizeof(bh));
+	trace_write_out(out, out->buf, out->buf_used);
     }
+    out->buf_used = 0;
+}
 
-    /* Set up SB */
-    sbOut = deepCopyIRSBExceptStmts(sbIn);
+/* Reserve a record of 'len' bytes in the current block */
+static void* trace_new_rec(struct mh_trace_out* out, UInt kind, UInt len)
+{
+    struct mh_trace_rec* rec;
+
+    len = (len + 7) & ~7;
+    tl_assert(len <= MH_TRACE_BLOCK_SIZE);
+    if (out->buf_used + len > MH_TRACE_BLOCK_SIZE)
+	trace_flush(out);
+    rec = (struct mh_trace_rec*)(out->buf + out->buf_used);
+    VG_(memset)(rec, 0, len);
+    rec->kind = kind;
+    rec->len = len;
+    out->buf_used += len;
+    return rec;
+}
 
-    // Copy verbatim any IR preamble preceding the first IMark
-    i = 0;
-    while (i < sbIn->stmts_used && sbIn->stmts[i]->tag != Ist_IMark) {
-	addStmtToIRSB(sbOut, sbIn->stmts[i]);
-	i++;
+/* Get trace stack id for 'id', write its stack record if first seen.
+   'ec' is the ExeContext of 'id' if known. */
+static UInt trace_stack(struct mh_trace_out* out, UInt id, ExeContext* ec)
+{
+    UInt ecu;
+    UInt bit;
+
+    if (is_lazy_stack(id)) {
+	ecu = lazy_stack(id)->ecu;
+	if (!ecu) {
+	    ec = stack_to_exe_context(id);
+	    ecu = VG_(get_ECU_from_ExeContext)(ec);
+	}
     }
+    else
+	ecu = id;
+
+    bit = ecu / 4;
+    if (bit / 8 >= out->stacks_done_size) {
+	UInt old_size = out->stacks_done_size;
+	out->stacks_done_size = MAX(bit / 8 + 1, 2 * old_size);
+	out->stacks_done = VG_(realloc)("mh.trace_stacks", out->stacks_done,
+					out->stacks_done_size);
+	VG_(memset)(out->stacks_done + old_size, 0,
+		    out->stacks_done_size - old_size);
+    }
+    if (!(out->stacks_done[bit / 8] & (1 << (bit % 8)))) {
+	struct mh_trace_stack* sr;
+	StackTrace ips;
+	UInt i, n_ips;
+
+	if (!ec || VG_(get_ECU_from_ExeContext)(ec) != ecu)
+	    ec = stack_to_exe_context(ecu);
+	ips = VG_(get_ExeContext_StackTrace)(ec);
+	n_ips = VG_(get_ExeContext_n_ips)(ec);
+	sr = trace_new_rec(out, MH_TRACE_REC_STACK,
+			   sizeof(*sr) + n_ips * sizeof(sr->ips[0]));
+	sr->stack = ecu;
+	sr->n_ips = n_ips;
+	for (i = 0; i < n_ips; i++)
+	    sr->ips[i] = ips[i];
+	out->stacks_done[bit / 8] |= 1 << (bit % 8);
+    }
+    return ecu;
+}
 
-    for (/*use current i*/; i < sbIn->stmts_used; i++) {
-	IRStmt* st = sbIn->stmts[i];
-	if (!st || st->tag == Ist_NoOp) continue;
+static void trace_store(struct mh_trace_out* out, Addr addr, SizeT size,
+			ULong data, ULong time, ULong icount,
+			ThreadId tid, UInt stack, ExeContext* ec)
+{
+    struct mh_trace_write* wr;
+    UInt ecu = trace_stack(out, stack, ec);
+
+    wr = trace_new_rec(out, MH_TRACE_REC_WRITE, sizeof(*wr));
+    wr->addr = addr;
+    wr->data = size <= sizeof(ULong) ? data : 0;
+    wr->time = time;
+    wr->icount = icount;
+    wr->stack = ecu;
+    wr->tid = tid;
+    wr->pad = 0;
+    wr->size = size;
+}
 
-	switch (st->tag) {
-	case Ist_NoOp:
-	case Ist_AbiHint:
-	case Ist_Put:
-	case Ist_PutI:
-	case Ist_MBE:
-	    break;
+static void trace_region(struct mh_trace_out* out,
+			 Bool created, Addr start, Addr end, ULong time,
+			 unsigned word_sz, unsigned history, const char* name)
+{
+    struct mh_trace_region* rr;
+    UInt name_len = created ? MIN(VG_(strlen)(name), 255) + 1 : 0;
+
+    rr = trace_new_rec(out, created ? MH_TRACE_REC_REGION : MH_TRACE_REC_UNTRACK,
+		       sizeof(*rr) + name_len);
+    rr->start = start;
+    rr->end = end;
+    rr->time = time;
+    rr->word_sz = word_sz;
+    rr->history = history;
+    if (name_len) {
+	VG_(memcpy)(rr->name, name, name_len - 1);
+	rr->name[name_len - 1] = '\0';
+    }
+}
 
-	case Ist_IMark:
-	    /* Remember pointer to current hw instruction */
-	    currIP = (HWord)st->Ist.IMark.addr;
+/* Create trace file, '%p' etc in 'name' are expanded as for 'option'.
+   A NULL 'option' uses 'name' as is, VG_(expand_file_name) terminates
+   the run on a bad '%' sequence which is not acceptable for names
+   coming from the client. Returns NULL if the file could not be created. */
+static struct mh_trace_out* trace_open(const HChar* option, const HChar* name)
+{
+    HChar* fname = option ? VG_(expand_file_name)(option, name)
+			  : VG_(strdup)("mh.trace_fname", name);
+    SysRes sres = VG_(open)(fname, VKI_O_CREAT | VKI_O_TRUNC | VKI_O_WRONLY,
+			    VKI_S_IRUSR | VKI_S_IWUSR);
+    struct mh_trace_out* out;
+    struct mh_trace_file_header fh;
+
+    if (sr_isError(sres)) {
+	VG_(umsg)("Can not create '%s'\n", fname);
+	VG_(free)(fname);
+	return NULL;
+    }
+    VG_(free)(fname);
+
+    out = VG_(malloc)("mh.trace_out", sizeof(*out));
+    out->fd = sr_Res(sres);
+    out->buf = VG_(malloc)("mh.trace_buf", MH_TRACE_BLOCK_SIZE);
+    out->buf_used = 0;
+    out->zbuf = VG_(malloc)("mh.trace_zbuf",
+			    VG_LZO1X_1_MAX_OUTPUT(MH_TRACE_BLOCK_SIZE));
+    out->lzo_wrkmem = VG_(malloc)("mh.trace_lzo", VG_LZO1X_1_MEM_COMPRESS);
+    out->stacks_done = NULL;
+    out->stacks_done_size = 0;
+
+    VG_(memset)(&fh, 0, sizeof(fh));
+    VG_(strcpy)(fh.magic, MH_TRACE_MAGIC);
+    fh.version = MH_TRACE_VERSION;
+    fh.block_size = MH_TRACE_BLOCK_SIZE;
+    fh.addr_size = sizeof(Addr);
+    trace_write_out(out, &fh, sizeof(fh));
+    return out;
+}
 
-	    if (enabled_tracking & MH_EXE) {
-		addEvent_Ir(sbOut, (HWord)st->Ist.IMark.addr,
-			    st->Ist.IMark.len);
-	    }
-	    break;
+static void trace_close(struct mh_trace_out* out)
+{
+    trace_flush(out);
+    if (out->fd >= 0)
+	VG_(close)(out->fd);
+    VG_(free)(out->buf);
+    VG_(free)(out->zbuf);
+    VG_(free)(out->lzo_wrkmem);
+    if (out->stacks_done)
+	VG_(free)(out->stacks_done);
+    VG_(free)(out);
+}
 
-	case Ist_WrTmp:
-	    if (enabled_tracking & MH_READ) {
-		IRExpr* data = st->Ist.WrTmp.data;
-		if (data->tag == Iex_Load) {
-		    addEvent_Dr(sbOut, data->Iex.Load.addr,
-				sizeofIRType(data->Iex.Load.ty), currIP);
-		}
-	    }
-	    break;
+/* Write all recorded history to binary file, in the same format as
+   --trace-file. Regions are written in address order and the history
+   of each word from oldest to newest. */
+static Bool dump_history(const HChar* option, const HChar* name)
+{
+    struct mh_trace_out* out = trace_open(option, name);
+    struct mh_region_t* rp;
 
-	case Ist_Store:
-	    if (enabled_tracking & MH_WRITE) {
-		IRExpr* data  = st->Ist.Store.data;
-		addEvent_Dw(sbOut, st->Ist.Store.addr,
-			    sizeofIRType(typeOfIRExpr(tyenv, data)),
-			    NULL,
-			    data,
-			    currIP);
-	    }
-	    break;
+    if (!out)
+	return False;
 
-	case Ist_StoreG:
-	    tl_assert(!"Tell Sverker he forgot to implement Ist_StoreGTo.");
-	    break;
+    for (rp = region_min(); rp; rp = region_succ(rp)) {
+	unsigned cix;
 
-	case Ist_LoadG:
-	    tl_assert(!"Tell Sverker he forgot to implement Ist_LoadG.");
-	    break;
+	if (!(rp->type & MH_TRACK))
+	    continue;
 
-	case Ist_Dirty: {
-	    Int      dsize;
-	    IRDirty* d = st->Ist.Dirty.details;
-	    if (d->mFx != Ifx_None) {
-		// This dirty helper accesses memory.  Collect the details.
-		tl_assert(d->mAddr != NULL);
-		tl_assert(d->mSize != 0);
-		dsize = d->mSize;
-		if ((enabled_tracking & MH_READ)
-		    && (d->mFx == Ifx_Read || d->mFx == Ifx_Modify))
-		{
-		    addEvent_Dr(sbOut, d->mAddr, dsize, currIP);
-		}
-		if ((enabled_tracking & MH_WRITE)
-		    && (d->mFx == Ifx_Write || d->mFx == Ifx_Modify))
-		{
-		    addEvent_Dw(sbOut, d->mAddr, dsize, NULL, NULL, currIP);
+	/* History 0 tells a region in heatmap mode, it has no writes */
+	trace_region(out, True, rp->start, rp->end, rp->birth_time_stamp,
+		     rp->word_sz, rp->heatmap ? 0 : rp->history, rp->name);
+	for (cix = 0; cix < rp->nchunks; cix++) {
+	    struct mh_hist_chunk_t* cp = rp->chunk_dir[cix];
+	    const unsigned cnwords = hist_chunk_nwords(rp, cix);
+	    unsigned c, h;
+
+	    if (!cp)
+		continue;
+	    for (c = 0; c < cnwords; c++) {
+		Addr addr = rp->start
+		    + (Addr)(cix * HIST_CHUNK_WORDS + c) * rp->word_sz;
+		unsigned hix = cp->hist_ix_vec[c];
+
+		for (h = 0; h < rp->history; h++) {
+		    unsigned i = hix * cnwords + c;
+		    if (cp->ecu[i]) {
+			trace_store(out, addr, rp->word_sz,
+				    hist_get_data(rp, cp, i), cp->time[i],
+				    cp->icount ? cp->icount[i] : 0,
+				    cp->tid[i], cp->ecu[i], NULL);
+		    }
+		    if (++hix == rp->history) hix = 0;
 		}
 	    }
-	    else {
-		tl_assert(d->mAddr == NULL);
-		tl_assert(d->mSize == 0);
-	    }
-	    break;
 	}
+    }
+    trace_close(out);
+    return True;
+}
 
-	case Ist_CAS: {
-	    Int    dataSize;
-	    IRCAS*  cas = st->Ist.CAS.details;
-	    IRExpr* data = cas->dataLo;
-	    IRExpr* expd = cas->expdLo;
-	    IROp mergeOp;
-	    tl_assert(cas->addr != NULL);
-	    tl_assert(cas->dataLo != NULL);
-	    dataSize = sizeofIRType(typeOfIRExpr(tyenv, cas->dataLo));
-	    tl_assert(dataSize == sizeofIRType(typeOfIRExpr(tyenv, cas->expdLo)));
+/* Copy the contents of [wa,wb) as they will be after the store of
+   'size' bytes from 'image' at 'addr'. Bytes outside the store (ragged
+   edges of partially written words) are read from memory, bytes
+   outside the region are zeroed. */
+static void copy_stored_words(struct mh_region_t* rp, UChar* dst,
+			      Addr wa, Addr wb,
+			      Addr addr, SizeT size, const UChar* image)
+{
+    Addr lo = MAX(wa, addr);
+    Addr hi = MIN(wb, addr + size);
+    Addr mem_end = MIN(wb, rp->end);
+
+    if (wa < lo)
+	VG_(memcpy)(dst, (void*)wa, lo - wa);
+    if (image)
+	VG_(memcpy)(dst + (lo - wa), image + (lo - addr), hi - lo);
+    else
+	VG_(memset)(dst + (lo - wa), 0, hi - lo);
+    if (hi < mem_end)
+	VG_(memcpy)(dst + (hi - wa), (void*)hi, mem_end - hi);
+    if (mem_end < wb)
+	VG_(memset)(dst + (mem_end - wa), 0, wb - mem_end);
+}
 
-	    if (cas->dataHi) { /* a doubleword-CAS */
-		dataSize *= 2;
-	    }
-	    if (enabled_tracking & MH_READ) {
-		addEvent_Dr(sbOut, cas->addr, dataSize, currIP);
-	    }
-	    if (enabled_tracking & MH_WRITE) {
-		if (cas->dataHi) {  /* a doubleword-CAS */
-		    switch (dataSize) {
-		    case  2:
-			mergeOp = Iop_8HLto16;   break;
-		    case  4:
-			mergeOp = Iop_16HLto32;  break;
-		    case  8:
-			mergeOp = Iop_32HLto64;  break;
-		    default:
-			tl_assert2(0, "doubleword CAS instruction with size %u not implemented", dataSize);
-		    }
-		    data = IRExpr_Binop(mergeOp, cas->dataHi, cas->dataLo);
-		    expd = IRExpr_Binop(mergeOp, cas->expdHi, cas->expdLo);
+/*
+ * False sharing detection, --false-sharing=yes
+ *
+ * Tracked regions are analysed per cache line. A line remembers the
+ * bytes written by its last writing thread within the time window.
+ * A write by another thread within the window to none of those bytes
+ * is counted as contended, and the stacks of the latest such pair
+ * of writes are kept for the report.
+ *
+ * Lines are created on first write in a hash table keyed by line
+ * address, shared by all regions, so that two tracked objects in the
+ * same line are seen. Uncontended lines are dropped when untracked.
+ */
+
+#define FS_LINE_SZ 64
+
+struct mh_fs_line_t {
+    struct mh_fs_line_t* next;  /* VgHashNode */
+    Addr line;                  /* VgHashNode key */
+    ULong time;      /* of last write */
+    ULong mask;      /* bytes written by 'tid' since 'time' - window */
+    ULong writes;
+    ULong contended;
+    UInt ecu;        /* stack of last write */
+    UInt c_ecu[2];   /* latest contending writes, earlier first */
+    ULong c_mask[2];
+    const char* name;       /* region of last write */
+    const char* c_name[2];
+    UShort tid;
+    UShort c_tid[2];
+};
+
+static VgHashTable fs_lines = NULL;
+static PoolAlloc* fs_line_pool = NULL;
+static struct mh_fs_line_t* fs_last_line = NULL;
+
+#define FS_REPORT_LINES 10
+
+static struct mh_fs_line_t* fs_line(Addr line)
+{
+    struct mh_fs_line_t* lp = fs_last_line;
+
+    if (lp && lp->line == line)
+	return lp;
+    lp = VG_(HT_lookup)(fs_lines, line);
+    if (!lp) {
+	lp = VG_(allocEltPA)(fs_line_pool);
+	VG_(memset)(lp, 0, sizeof(*lp));
+	lp->line = line;
+	VG_(HT_add_node)(fs_lines, lp);
+    }
+    fs_last_line = lp;
+    return lp;
+}
+
+static void fs_store(struct mh_region_t* rp, ThreadId tid,
+		     Addr start, Addr end, UInt ecu)
+{
+    Addr a = start;
+
+    while (a < end) {
+	const Addr line = a & ~(Addr)(FS_LINE_SZ - 1);
+	struct mh_fs_line_t* lp = fs_line(line);
+	const Addr b = MIN(end, line + FS_LINE_SZ);
+	const unsigned lo = a % FS_LINE_SZ;
+	const unsigned n = b - a;
+	const ULong mask = (n == 64 ? ~0ULL : ((1ULL << n) - 1)) << lo;
+	const Bool recent = lp->ecu
+	    && mh_logical_time - lp->time <= (ULong)clo_false_sharing_window;
+
+	if (recent && lp->tid != tid) {
+	    if (!(mask & lp->mask)) {
+		lp->contended++;
+		stack_retain(lp->ecu, 1);
+		stack_retain(ecu, 1);
+		if (lp->c_ecu[0]) {
+		    stack_release(lp->c_ecu[0], 1);
+		    stack_release(lp->c_ecu[1], 1);
 		}
-		addEvent_Dw(sbOut, cas->addr, dataSize, expd, data, currIP);
+		lp->c_ecu[0] = lp->ecu;
+		lp->c_mask[0] = lp->mask;
+		lp->c_tid[0] = lp->tid;
+		lp->c_name[0] = lp->name;
+		lp->c_ecu[1] = ecu;
+		lp->c_mask[1] = mask;
+		lp->c_tid[1] = tid;
+		lp->c_name[1] = rp->name;
 	    }
-	    break;
+	    lp->mask = mask;
 	}
+	else if (recent)
+	    lp->mask |= mask;
+	else
+	    lp->mask = mask;
+
+	stack_retain(ecu, 1);
+	if (lp->ecu)
+	    stack_release(lp->ecu, 1);
+	lp->ecu = ecu;
+	lp->tid = tid;
+	lp->name = rp->name;
+	lp->time = mh_logical_time;
+	lp->writes++;
+	a = b;
+    }
+}
 
-	case Ist_LLSC: {
-	    IRType dataTy;
-	    if (st->Ist.LLSC.storedata == NULL) {
-		/* LL */
-		if (enabled_tracking & MH_READ) {
-		    dataTy = typeOfIRTemp(tyenv, st->Ist.LLSC.result);
-		    addEvent_Dr(sbOut, st->Ist.LLSC.addr,
-				sizeofIRType(dataTy), currIP);
-		}
+/* Drop line unless contended or shared with a tracked region */
+static void fs_drop_line(Addr line)
+{
+    struct mh_fs_line_t* lp = VG_(HT_lookup)(fs_lines, line);
+    struct mh_region_t* rp;
+
+    if (!lp || lp->contended)
+	return;
+    for (rp = region_lookup_min_overlap(line, line + FS_LINE_SZ);
+	 rp && rp->start < line + FS_LINE_SZ; rp = region_succ(rp)) {
+	if (rp->type & MH_TRACK)
+	    return;
+    }
+    VG_(HT_remove)(fs_lines, line);
+    if (lp->ecu)
+	stack_release(lp->ecu, 1);
+    if (lp == fs_last_line)
+	fs_last_line = NULL;
+    VG_(freeEltPA)(fs_line_pool, lp);
+}
+
+/* Region is no longer tracked, drop its uncontended lines. Visit the
+   lines of the region or the whole table, whichever is smaller. */
+static void fs_untrack(struct mh_region_t* rp)
+{
+    const Addr first = rp->start & ~(Addr)(FS_LINE_SZ - 1);
+    const UWord nlines = (rp->end - first + FS_LINE_SZ - 1) / FS_LINE_SZ;
+    Addr line;
+
+    if (!fs_lines)
+	return;
+    if (nlines <= VG_(HT_count_nodes)(fs_lines)) {
+	for (line = first; line < rp->end; line += FS_LINE_SZ)
+	    fs_drop_line(line);
+    }
+    else {
+	UInt i, n;
+	VgHashNode** v = VG_(HT_to_array)(fs_lines, &n);
+
+	for (i = 0; i < n; i++) {
+	    line = ((struct mh_fs_line_t*)v[i])->line;
+	    if (line >= first && line < rp->end)
+		fs_drop_line(line);
+	}
+	VG_(free)(v);
+    }
+}
+
+static Int fs_report_cmp(const void* a, const void* b)
+{
+    const struct mh_fs_line_t* x = *(const struct mh_fs_line_t* const*)a;
+    const struct mh_fs_line_t* y = *(const struct mh_fs_line_t* const*)b;
+
+    if (x->contended != y->contended)
+	return x->contended > y->contended ? -1 : 1;
+    return x->line < y->line ? -1 : x->line > y->line;
+}
+
+static void fs_print_report(void)
+{
+    VgHashNode** v;
+    UInt i, j, n, ncont = 0;
+
+    v = VG_(HT_to_array)(fs_lines, &n);
+    for (i = 0; i < n; i++) {
+	if (((struct mh_fs_line_t*)v[i])->contended)
+	    v[ncont++] = v[i];
+    }
+    VG_(umsg)("False sharing: %u cache lines written by different threads "
+	      "to disjoint bytes.\n", ncont);
+    VG_(ssort)(v, ncont, sizeof(*v), fs_report_cmp);
+    for (i = 0; i < MIN(ncont, FS_REPORT_LINES); i++) {
+	const struct mh_fs_line_t* lp = (struct mh_fs_line_t*)v[i];
+
+	VG_(umsg)("Cache line %p: %llu of %llu writes contended, "
+		  "last by:\n", (void*)lp->line, lp->contended, lp->writes);
+	for (j = 0; j < 2; j++) {
+	    VG_(umsg)("  thread %u writing byte mask %#llx in '%s'\n",
+		      lp->c_tid[j], lp->c_mask[j], lp->c_name[j]);
+	    VG_(pp_ExeContext)(stack_to_exe_context(lp->c_ecu[j]));
+	}
+    }
+    if (ncont > FS_REPORT_LINES)
+	VG_(umsg)("%u less contended lines not shown.\n",
+		  ncont - FS_REPORT_LINES);
+    VG_(free)(v);
+}
+
+/*
+ * Write frequency heatmap, --summary=heatmap or history 0
+ *
+ * Instead of history, a region in heatmap mode counts writes per word,
+ * and per word and stack in an open addressing hash table. Stacks are
+ * keyed by ExeContext unique id, lazy stacks are interned first.
+ */
+
+struct mh_heat_ent_t {
+    ULong count;
+    UInt wix;
+    UInt ecu;        /* ExeContext unique id, 0 if free */
+};
+
+struct mh_heatmap_t {
+    ULong* counts;   /* per word, NULL if not written */
+    struct mh_heat_ent_t* tab;
+    UInt tab_size;   /* power of 2 */
+    UInt tab_used;
+};
+
+#define HEATMAP_INIT_SIZE 64
+#define HEATMAP_REPORT_ENTRIES 20
+
+static UInt heat_hash(UInt wix, UInt ecu)
+{
+    return (wix * 0x9E3779B1U) ^ (ecu * 0x85EBCA6BU);
+}
+
+static void heat_insert(struct mh_heatmap_t* hm, UInt wix, UInt ecu,
+			ULong count)
+{
+    UInt mask = hm->tab_size - 1;
+    UInt i = heat_hash(wix, ecu) & mask;
+
+    while (hm->tab[i].ecu
+	   && (hm->tab[i].ecu != ecu || hm->tab[i].wix != wix))
+	i = (i + 1) & mask;
+    if (!hm->tab[i].ecu) {
+	hm->tab[i].ecu = ecu;
+	hm->tab[i].wix = wix;
+	hm->tab_used++;
+    }
+    hm->tab[i].count += count;
+}
+
+static void heat_grow(struct mh_heatmap_t* hm)
+{
+    struct mh_heat_ent_t* old = hm->tab;
+    UInt i, old_size = hm->tab_size;
+
+    hm->tab_size = old_size ? 2 * old_size : HEATMAP_INIT_SIZE;
+    hm->tab = VG_(calloc)("mh.heat_tab", hm->tab_size, sizeof(*hm->tab));
+    hm->tab_used = 0;
+    for (i = 0; i < old_size; i++) {
+	if (old[i].ecu)
+	    heat_insert(hm, old[i].wix, old[i].ecu, old[i].count);
+    }
+    if (old)
+	VG_(free)(old);
+}
+
+static void heat_store(struct mh_region_t* rp, unsigned wix,
+		       unsigned end_wix, UInt ecu)
+{
+    struct mh_heatmap_t* hm = rp->heatmap;
+
+    if (is_lazy_stack(ecu))
+	ecu = VG_(get_ECU_from_ExeContext)(stack_to_exe_context(ecu));
+    if (!hm->counts)
+	hm->counts = VG_(calloc)("mh.heat_counts", rp->nwords, sizeof(ULong));
+    for (; wix < end_wix; wix++) {
+	hm->counts[wix]++;
+	if (4 * (hm->tab_used + 1) > 3 * hm->tab_size)
+	    heat_grow(hm);
+	heat_insert(hm, wix, ecu, 1);
+    }
+}
+
+static void heat_free(struct mh_region_t* rp)
+{
+    struct mh_heatmap_t* hm = rp->heatmap;
+
+    if (!hm)
+	return;
+    if (hm->tab)
+	VG_(free)(hm->tab);
+    if (hm->counts)
+	VG_(free)(hm->counts);
+    VG_(free)(hm);
+    rp->heatmap = NULL;
+}
+
+static Int heat_ent_cmp(const void* a, const void* b)
+{
+    const struct mh_heat_ent_t* x = a;
+    const struct mh_heat_ent_t* y = b;
+
+    if (x->count != y->count)
+	return x->count > y->count ? -1 : 1;
+    return x->wix < y->wix ? -1 : x->wix > y->wix;
+}
+
+/* Print write counts of the words of heatmap region 'rp' that overlap
+   [start,end) */
+static void print_heatmap(struct mh_region_t* rp, Addr start, Addr end)
+{
+    struct mh_heatmap_t* hm = rp->heatmap;
+    struct mh_heat_ent_t* ents;
+    UInt i, wix, end_wix, n = 0;
+    ULong total = 0;
+
+    start = MAX(start, rp->start);
+    end = MIN(end, rp->end);
+    if (start >= end)
+	return;
+    wix = (start - rp->start) / rp->word_sz;
+    end_wix = (end - rp->start - 1) / rp->word_sz + 1;
+
+    if (rp->sample_rate > 1) {
+	VG_(umsg)("Counts are of sampled writes, one in %u of %llu "
+		  "writes to the region.\n", rp->sample_rate, rp->writes);
+    }
+    if (hm->counts) {
+	for (i = wix; i < end_wix; i++)
+	    total += hm->counts[i];
+    }
+    if (!total) {
+	VG_(umsg)("%u-bytes from %p to %p not written.\n",
+		  rp->word_sz, (void*)start, (void*)end);
+	return;
+    }
+
+    /* Rank (word, stack) pairs by write count */
+    ents = VG_(malloc)("mh.heat_print", hm->tab_used * sizeof(*ents));
+    for (i = 0; i < hm->tab_size; i++) {
+	if (hm->tab[i].ecu && hm->tab[i].wix >= wix
+	    && hm->tab[i].wix < end_wix)
+	    ents[n++] = hm->tab[i];
+    }
+    VG_(ssort)(ents, n, sizeof(*ents), heat_ent_cmp);
+
+    VG_(umsg)("%llu writes from %u distinct (word, stack) pairs.\n",
+	      total, n);
+    for (i = 0; i < MIN(n, HEATMAP_REPORT_ENTRIES); i++) {
+	VG_(umsg)("%llu writes (%llu%%) to %u-bytes at %p (offset %u):\n",
+		  ents[i].count, ents[i].count * 100 / total, rp->word_sz,
+		  (void*)(rp->start + (Addr)ents[i].wix * rp->word_sz),
+		  ents[i].wix * rp->word_sz);
+	VG_(pp_ExeContext)(stack_to_exe_context(ents[i].ecu));
+    }
+    if (n > HEATMAP_REPORT_ENTRIES)
+	VG_(umsg)("%u less frequent pairs not shown.\n",
+		  n - HEATMAP_REPORT_ENTRIES);
+    VG_(free)(ents);
+
+    if (clo_heatmap_words) {
+	VG_(umsg)("Writes per %u-bytes word:\n", rp->word_sz);
+	for (i = wix; i < end_wix; i++) {
+	    if (hm->counts[i])
+		VG_(umsg)("  offset %6u: %llu\n", i * rp->word_sz,
+			  hm->counts[i]);
+	}
+    }
+}
+
+static UInt sample_seed = 1;
+
+/* Record store of 'size' bytes at 'addr'. The stored bytes are given
+   by 'image' if not NULL, else by 'data' if size <= 8. 'done' is set
+   if memory already holds the stored bytes. Returns False if the store
+   was not recorded due to thread filter, changes-only or sampling. */
+static Bool report_store_in_block(struct mh_region_t* rp,
+			       Addr addr, SizeT size, ULong data,
+			       const UChar* image, Bool done)
+{
+    ThreadId tid = VG_(get_running_tid)();  // Should tid be passed as arg instead?
+    ExeContext* ec = NULL;
+    UInt ecu = 0;
+    unsigned wix; /* word index */
+    unsigned end_wix;
+    Addr start = MAX(addr, rp->start);
+    Addr end = MIN(addr + size, rp->end);
+
+    if (clo_false_sharing) {
+	ecu = stack_capture(tid, &ec);
+	fs_store(rp, tid, start, end, ecu);
+    }
+
+    switch (rp->thread_filter) {
+    case MH_THREADS_ALL:
+	break;
+    case MH_THREADS_NOT_OWNER:
+	if (tid == rp->owner)
+	    return False;
+	break;
+    case MH_THREADS_SET:
+	if (!(rp->threads[tid / 8] & (1 << (tid % 8))))
+	    return False;
+	break;
+    }
+
+    if (!image && size <= sizeof(ULong)) {
+	image = (const UChar*)&data;
+#if defined(VG_BIGENDIAN)
+	image += sizeof(ULong) - size;
+#endif
+    }
+
+    /* Unless the store is done, memory still holds the old value */
+    if (rp->changes_only && image && !done
+	&& !VG_(memcmp)((void*)start, image + (start - addr), end - start)) {
+	stat_silent_stores++;
+	return False;
+    }
+
+    /* Sampling, countdown per region and thread as each thread is a
+       stream of writes of its own. The countdown is random with mean
+       sample_rate, so that periodic write patterns are not sampled at
+       the same place every time. */
+    rp->writes++;
+    if (rp->sample_rate > 1) {
+	UInt* countdown = rp->sample_countdown;
+
+	if (!countdown) {
+	    countdown = VG_(calloc)("mh.sample_countdown", VG_N_THREADS,
+				    sizeof(UInt));
+	    rp->sample_countdown = countdown;
+	}
+	if (countdown[tid] > 1) {
+	    countdown[tid]--;
+	    return False;
+	}
+	countdown[tid] = 1 + VG_(random)(&sample_seed)
+	    % (2 * rp->sample_rate - 1);
+    }
+
+    if (!clo_false_sharing)
+	ecu = stack_capture(tid, &ec);
+    stat_stores++;
+
+    wix = (start - rp->start) / rp->word_sz;
+    end_wix = (end - rp->start - 1) / rp->word_sz + 1;
+    tl_assert(wix < end_wix);
+    tl_assert(end_wix <= rp->nwords);
+
+    if (clo_trace_mem) {
+	VG_(umsg)("TRACE: %u bytes written at addr %p at time %llu:\n",
+		  (unsigned)size, (void*)addr, mh_logical_time);
+	VG_(pp_ExeContext)(stack_to_exe_context(ecu));
+    }
+
+    if (trace_out)
+	trace_store(trace_out, addr, size, data, mh_logical_time,
+		    mh_instr_count, tid, ecu, ec);
+
+    if (rp->heatmap) {
+	heat_store(rp, wix, end_wix, ecu);
+	return True;
+    }
+
+    /* For each chunk, update runs of words with the same ring position
+       as one row segment. */
+    while (wix < end_wix) {
+	struct mh_hist_chunk_t* cp = hist_chunk(rp, wix);
+	const unsigned chunk_wix = wix - wix % HIST_CHUNK_WORDS;
+	const unsigned cnwords = hist_chunk_nwords(rp, chunk_wix / HIST_CHUNK_WORDS);
+	unsigned c = wix - chunk_wix;
+	const unsigned cend = MIN(end_wix - chunk_wix, cnwords);
+
+	while (c < cend) {
+	    const unsigned hix = cp->hist_ix_vec[c];
+	    const unsigned next_hix = (hix + 1 < rp->history) ? hix + 1 : 0;
+	    unsigned i = hix * cnwords + c;
+	    unsigned r, n;
+
+	    for (r = c + 1; r < cend && cp->hist_ix_vec[r] == hix; r++)
+		;
+	    n = r - c;
+	    //VG_(umsg)("TRACE: Saving at wix=%u hix=%u n=%u\n", chunk_wix + c, hix, n);
+	    if (clo_history_stack == MH_STACK_LAZY) {
+		for (r = 0; r < n; r++) {
+		    if (cp->ecu[i + r])
+			stack_release(cp->ecu[i + r], 1);
+		}
+		stack_retain(ecu, n);
+	    }
+	    for (r = 0; r < n; r++) {
+		cp->ecu[i + r] = ecu;
+		cp->time[i + r] = mh_logical_time;
+		cp->tid[i + r] = tid;
+		cp->hist_ix_vec[c + r] = next_hix;
+	    }
+	    if (cp->icount) {
+		for (r = 0; r < n; r++)
+		    cp->icount[i + r] = mh_instr_count;
+	    }
+	    if (rp->data_sz) {
+		Addr wa = rp->start + (Addr)(chunk_wix + c) * rp->word_sz;
+		copy_stored_words(rp, (UChar*)cp->data + i * rp->data_sz,
+				  wa, wa + n * rp->word_sz, addr, size, image);
+	    }
+	    c += n;
+	}
+	wix = chunk_wix + cend;
+    }
+    return True;
+}
+
+static unsigned protection_disable_counter = 0;
+
+/* Inline cache, one per instrumented load/store.
+   Remembers the last region the access hit, valid as long as
+   'gen' equals mh_region_gen. A zeroed slot is never valid.
+ */
+struct mh_site_cache_t {
+    struct mh_region_t* region;
+    UWord gen;
+};
+
+/* Site caches are kept per guest instruction and access index within
+   the instruction. They are never freed, as translations may still
+   refer to them, but a retranslation of the same code reuses them.
+   Two translations sharing a cache is harmless, a hit is always
+   checked against the accessed range. */
+struct mh_site_t {
+    struct mh_site_t* next;     /* VgHashNode */
+    Addr ip;                    /* VgHashNode key */
+    struct mh_site_t* next_ix;  /* next access of same instruction */
+    struct mh_site_cache_t cache;
+};
+
+static VgHashTable mh_sites = NULL;
+static PoolAlloc* site_pool = NULL;
+
+static struct mh_site_t* new_site(Addr ip)
+{
+    struct mh_site_t* sp = VG_(allocEltPA)(site_pool);
+
+    sp->ip = ip;
+    sp->next_ix = NULL;
+    sp->cache.region = NULL;
+    sp->cache.gen = 0;
+    return sp;
+}
+
+/* Instruction and access index of the last site_cache() call.
+   Reset for each superblock by mh_instrument. */
+static Addr site_last_ip = 0;
+static UInt site_last_ix = 0;
+
+/* Cache for the next access of instruction 'ip' at instrumentation.
+   Accesses are numbered in the order they are instrumented. */
+static struct mh_site_cache_t* site_cache(Addr ip)
+{
+    struct mh_site_t* sp = VG_(HT_lookup)(mh_sites, ip);
+    UInt ix = (ip == site_last_ip) ? site_last_ix + 1 : 0;
+    UInt i;
+
+    site_last_ip = ip;
+    site_last_ix = ix;
+
+    if (!sp) {
+	sp = new_site(ip);
+	VG_(HT_add_node)(mh_sites, sp);
+    }
+    for (i = 0; i < ix; i++) {
+	if (!sp->next_ix)
+	    sp->next_ix = new_site(ip);
+	sp = sp->next_ix;
+    }
+    return &sp->cache;
+}
+
+static Int track_mem_access(Addr addr, SizeT size, Long data,
+			    const UChar* image, enum mh_track_type type,
+			    struct mh_site_cache_t* cache)
+{
+    Addr start = addr;
+    Addr end = addr + size;
+    struct mh_region_t* rp;
+    Bool got_a_hit = 0;
+
+    if (cache && cache->gen == mh_region_gen
+	&& cache->region->start <= start && end <= cache->region->end) {
+	rp = cache->region;
+    }
+    else {
+	rp = region_lookup_access(addr, end);
+	if (!rp) return 0;
+
+	if (cache && rp->start <= start && end <= rp->end) {
+	    cache->region = rp;
+	    cache->gen = mh_region_gen;
+	}
+    }
+
+    do {
+	tl_assert(end > rp->start && start < rp->end);
+
+	if (rp->enabled) {
+	    Bool hit = (type != MH_WRITE_CHECK);
+
+	    switch (type) {
+	    case MH_WRITE:
+		if ((rp->type & MH_WRITE) && !protection_disable_counter) {
+		    VG_(umsg)("Provoking SEGV: %u bytes WRITTEN to protected "
+			      "region '%s' at addr %p at time %llu:\n",
+			      (unsigned)size, rp->name, (void*)addr,
+			      mh_logical_time);
+		    return 1; /* Crash! */
+		}
+		if (rp->type & MH_TRACK) {
+		    hit = report_store_in_block(rp, addr, size, data, image,
+						False);
+		}
+		break;
+
+	    case MH_WRITE_CHECK:
+		if ((rp->type & MH_WRITE) && !protection_disable_counter) {
+		    VG_(umsg)("Provoking SEGV: %u bytes WRITTEN to protected "
+			      "region '%s' at addr %p at time %llu:\n",
+			      (unsigned)size, rp->name, (void*)addr,
+			      mh_logical_time);
+		    return 1; /* Crash! */
+		}
+		break;
+
+	    case MH_WRITE_DONE:
+		if (rp->type & MH_TRACK) {
+		    if (size <= sizeof(ULong)) {
+			UChar* dp = (UChar*)&data;
+#if defined(VG_BIGENDIAN)
+			dp += sizeof(ULong) - size;
+#endif
+			VG_(memcpy)(dp, (void*)addr, size);
+			hit = report_store_in_block(rp, addr, size, data,
+						    NULL, True);
+		    }
+		    else
+			hit = report_store_in_block(rp, addr, size, 0,
+						    (const UChar*)addr, True);
+		}
+		break;
+
+	    case MH_READ:
+		if ((rp->type & MH_READ) && !protection_disable_counter) {
+		    VG_(umsg)("Provoking SEGV: %u bytes READ from protected "
+			      "region '%s' at addr %p at time %llu:\n",
+			      (unsigned)size, rp->name, (void*)addr,
+			      mh_logical_time);
+		    return 1; /* Crash! */
+		}
+		break;
+
+	    case MH_EXE:
+		if ((rp->type & MH_EXE) && !protection_disable_counter) {
+		    VG_(umsg)("Provoking SEGV: %u-byte instruction executed in protected "
+			      "region '%s' at addr %p at time %llu:\n",
+			      (unsigned)size, rp->name, (void*)addr,
+			      mh_logical_time);
+		    return 1; /* Crash! */
+		}
+		break;
+
+	    default:
+		tl_assert2(0, "Invalid mem access type %x", type);
+	    }
+	    if (hit)
+		got_a_hit = 1;
+	}
+	if (end <= rp->end) break;
+
+	rp = region_succ(rp);
+    }while (rp && end > rp->start);
+
+    if (got_a_hit) ++mh_logical_time;
+
+    return 0; /* Ok */
+}
+
+/* Result of last track call, nonzero if instrumented code should provoke
+   SEGV. The helpers are called conditionally (see emit_range_guard) and
+   VEX can not return values from conditional calls on all hosts.
+ */
+static UInt mh_provoke_segv = 0;
+
+#define track_REGPARM 2
+
+VG_REGPARM(track_REGPARM)
+static void track_store(Addr addr, SizeT size, Long data,
+			struct mh_site_cache_t* cache)
+{
+    mh_provoke_segv = track_mem_access(addr, size, data, NULL, MH_WRITE, cache);
+}
+
+/* Stores wider than 8 bytes, with the data in mh_store_scratch */
+static UChar mh_store_scratch[MAX_STORE_DATA] __attribute__((aligned(32)));
+
+VG_REGPARM(track_REGPARM)
+static void track_store_wide(Addr addr, SizeT size,
+			     struct mh_site_cache_t* cache)
+{
+    mh_provoke_segv = track_mem_access(addr, size, 0, mh_store_scratch,
+				       MH_WRITE, cache);
+}
+
+/* Stores by dirty helpers, called before and after the helper */
+VG_REGPARM(track_REGPARM)
+static void track_store_check(Addr addr, SizeT size,
+			      struct mh_site_cache_t* cache)
+{
+    mh_provoke_segv = track_mem_access(addr, size, 0, NULL,
+				       MH_WRITE_CHECK, cache);
+}
+
+VG_REGPARM(track_REGPARM)
+static void track_store_done(Addr addr, SizeT size,
+			     struct mh_site_cache_t* cache)
+{
+    track_mem_access(addr, size, 0, NULL, MH_WRITE_DONE, cache);
+}
+
+VG_REGPARM(track_REGPARM)
+static void track_load(Addr addr, SizeT size, struct mh_site_cache_t* cache)
+{
+    mh_provoke_segv = track_mem_access(addr, size, 0, NULL, MH_READ, cache);
+}
+
+VG_REGPARM(track_REGPARM)
+static void track_exe(Addr addr, SizeT size)
+{
+    mh_provoke_segv = track_mem_access(addr, size, 0, NULL, MH_EXE, NULL);
+}
+
+VG_REGPARM(track_REGPARM)
+static void track_cas(Addr addr, SizeT size, ULong expected, ULong data,
+		      struct mh_site_cache_t* cache)
+{
+    ULong actual;
+    MH_ASSERT2(fit_in_ubytes(expected, size), " expected=%llx size=%u", expected, (int)size);
+    MH_ASSERT2(fit_in_ubytes(data, size), " data=%llx size=%u", data, (int)size);
+    switch (size) {
+    case 1: actual = *(UChar*)addr;  break;
+    case 2: actual = *(UShort*)addr; break;
+    case 4: actual = *(UInt*)addr;   break;
+    case 8: actual = *(ULong*)addr;  break;
+    default:
+	tl_assert2(0, "CAS on %u-words not implemented", size);
+    }
+    if (actual == expected)
+	track_store(addr, size, data, cache);
+    else
+	mh_provoke_segv = 0;
+}
+
+
+
+#if VEX_HOST_WORDSIZE == 4
+    #define IRConst_HWord IRConst_U32
+    #define Ity_HWord Ity_I32
+    #define HWord_LOG2 2
+    #define Iop_AddHWord Iop_Add32
+    #define Iop_AndHWord Iop_And32
+    #define Iop_ShlHWord Iop_Shl32
+    #define Iop_ShrHWord Iop_Shr32
+    #define Iop_CmpNEHWord Iop_CmpNE32
+    #define Iop_CmpLTHWordU Iop_CmpLT32U
+    #define Iop_HWordto8 Iop_32to8
+#elif VEX_HOST_WORDSIZE == 8
+    #define IRConst_HWord IRConst_U64
+    #define Ity_HWord Ity_I64
+    #define HWord_LOG2 3
+    #define Iop_AddHWord Iop_Add64
+    #define Iop_AndHWord Iop_And64
+    #define Iop_ShlHWord Iop_Shl64
+    #define Iop_ShrHWord Iop_Shr64
+    #define Iop_CmpNEHWord Iop_CmpNE64
+    #define Iop_CmpLTHWordU Iop_CmpLT64U
+    #define Iop_HWordto8 Iop_64to8
+#else
+    #error "VEX_HOST_WORDSIZE not set to 4 or 8"
+#endif
+
+#if defined(VG_BIGENDIAN)
+    #define Iend_Host Iend_BE
+#else
+    #define Iend_Host Iend_LE
+#endif
+
+
+static IRType size2itype(int size)
+{
+    IRType type;
+    switch (size) {
+    case 1: type = Ity_I8;   break;
+    case 2: type = Ity_I16;  break;
+    case 4: type = Ity_I32;  break;
+    case 8: type = Ity_I64;  break;
+    case 16: type = Ity_I128; break;
+    default:
+	tl_assert2(0, "Invalid integer size %u", size);
+    }
+    return type;
+}
+
+
+static IRExpr* expr2atom(IRSB* sb, IRExpr* e)
+{
+    if (!isIRAtom(e)) {
+	Int size = sizeofIRType(typeOfIRExpr(sb->tyenv, e));
+	IRTemp tmp = newIRTemp(sb->tyenv, size2itype(size));
+	addStmtToIRSB(sb, IRStmt_WrTmp(tmp, e));
+	e = IRExpr_RdTmp(tmp);
+    }
+    return e;
+}
+
+static IRExpr* assign_new(IRSB* sb, IRType ty, IRExpr* e)
+{
+    IRTemp tmp = newIRTemp(sb->tyenv, ty);
+    addStmtToIRSB(sb, IRStmt_WrTmp(tmp, e));
+    return IRExpr_RdTmp(tmp);
+}
+
+static IRExpr*
+widen_to_U64(IRSB* sb, IRExpr* iexpr)
+{
+    Int size;
+
+    switch (typeOfIRExpr(sb->tyenv, iexpr)) {
+    case Ity_F32:
+	iexpr = assign_new(sb, Ity_I32, IRExpr_Unop(Iop_ReinterpF32asI32, iexpr));
+	break;
+    case Ity_F64:
+	return IRExpr_Unop(Iop_ReinterpF64asI64, iexpr);
+    case Ity_D64:
+	return IRExpr_Unop(Iop_ReinterpD64asI64, iexpr);
+    default:
+	break;
+    }
+    size = sizeofIRType(typeOfIRExpr(sb->tyenv, iexpr));
+    switch (size) {
+    case 1: return IRExpr_Unop(Iop_8Uto64, iexpr);
+    case 2: return IRExpr_Unop(Iop_16Uto64, iexpr);
+    case 4: return IRExpr_Unop(Iop_32Uto64, iexpr);
+    case 8: return iexpr;
+    }
+    return NULL;
+}
+
+static IRExpr* mkU8(UInt i)
+{
+    return IRExpr_Const(IRConst_U8(i));
+}
+
+/* Emit inline lookup of the page map bit for addr.
+ *
+ * Return Ity_I32 expression, 1 if bit is set, otherwise 0.
+ */
+static IRExpr* emit_page_map_test(IRSB* sb, IRExpr* addr)
+{
+    IRExpr* ix;
+    IRExpr* inside;
+    IRExpr* sm;
+    IRExpr* woff;
+    IRExpr* word;
+    IRExpr* shift;
+    IRExpr* bit;
+
+    /*  sm = pm_primary_map[MIN(addr >> 28, PM_PRIMARY_SIZE-1)] */
+    ix = assign_new(sb, Ity_HWord,
+		    IRExpr_Binop(Iop_ShrHWord, addr,
+				 mkU8(PM_PAGE_BITS + PM_SEC_BITS)));
+    inside = assign_new(sb, Ity_I1,
+			IRExpr_Binop(Iop_CmpLTHWordU, ix,
+				     mkIRExpr_HWord(PM_PRIMARY_SIZE - 1)));
+    ix = assign_new(sb, Ity_HWord,
+		    IRExpr_ITE(inside, ix,
+			       mkIRExpr_HWord(PM_PRIMARY_SIZE - 1)));
+    ix = assign_new(sb, Ity_HWord,
+		    IRExpr_Binop(Iop_ShlHWord, ix, mkU8(HWord_LOG2)));
+    ix = assign_new(sb, Ity_HWord,
+		    IRExpr_Binop(Iop_AddHWord, ix,
+				 mkIRExpr_HWord((HWord)pm_primary_map)));
+    sm = assign_new(sb, Ity_HWord, IRExpr_Load(Iend_Host, Ity_HWord, ix));
+
+    /*  word = sm->bits[(page % PM_SEC_PAGES) / PM_WORD_BITS] */
+    woff = assign_new(sb, Ity_HWord,
+		      IRExpr_Binop(Iop_ShrHWord, addr,
+				   mkU8(PM_PAGE_BITS + 3 + HWord_LOG2)));
+    woff = assign_new(sb, Ity_HWord,
+		      IRExpr_Binop(Iop_AndHWord, woff,
+				   mkIRExpr_HWord(PM_SEC_PAGES / PM_WORD_BITS - 1)));
+    woff = assign_new(sb, Ity_HWord,
+		      IRExpr_Binop(Iop_ShlHWord, woff, mkU8(HWord_LOG2)));
+    woff = assign_new(sb, Ity_HWord,
+		      IRExpr_Binop(Iop_AddHWord, sm, woff));
+    word = assign_new(sb, Ity_HWord, IRExpr_Load(Iend_Host, Ity_HWord, woff));
+
+    /*  bit = (word >> (page % PM_WORD_BITS)) & 1 */
+    shift = assign_new(sb, Ity_HWord,
+		       IRExpr_Binop(Iop_ShrHWord, addr, mkU8(PM_PAGE_BITS)));
+    shift = assign_new(sb, Ity_HWord,
+		       IRExpr_Binop(Iop_AndHWord, shift,
+				    mkIRExpr_HWord(PM_WORD_BITS - 1)));
+    shift = assign_new(sb, Ity_I8, IRExpr_Unop(Iop_HWordto8, shift));
+    bit = assign_new(sb, Ity_HWord,
+		     IRExpr_Binop(Iop_ShrHWord, word, shift));
+    bit = assign_new(sb, Ity_HWord,
+		     IRExpr_Binop(Iop_AndHWord, bit, mkIRExpr_HWord(1)));
+    bit = assign_new(sb, Ity_I1,
+		     IRExpr_Binop(Iop_CmpNEHWord, bit, mkIRExpr_HWord(0)));
+    return assign_new(sb, Ity_I32, IRExpr_Unop(Iop_1Uto32, bit));
+}
+
+/* Emit inline test if [addr, addr+size) may overlap any region,
+ * that is if it overlaps [mh_tree_min, mh_tree_max) and starts
+ * in a page marked in the page map.
+ *
+ * Return Ity_I1 expression to be used as guard for the track call.
+ */
+static IRExpr* emit_range_guard(IRSB* sb, IRExpr* addr, UInt size)
+{
+    IRExpr* tree_min;
+    IRExpr* tree_max;
+    IRExpr* end;
+    IRExpr* below_max;
+    IRExpr* above_min;
+    IRExpr* both;
+
+    tree_min = assign_new(sb, Ity_HWord,
+			  IRExpr_Load(Iend_Host, Ity_HWord,
+				      mkIRExpr_HWord((HWord)&mh_tree_min)));
+    tree_max = assign_new(sb, Ity_HWord,
+			  IRExpr_Load(Iend_Host, Ity_HWord,
+				      mkIRExpr_HWord((HWord)&mh_tree_max)));
+    end = assign_new(sb, Ity_HWord,
+		     IRExpr_Binop(Iop_AddHWord, addr, mkIRExpr_HWord(size)));
+
+    /*  addr < tree_max && end > tree_min */
+    below_max = assign_new(sb, Ity_I1,
+			   IRExpr_Binop(Iop_CmpLTHWordU, addr, tree_max));
+    below_max = assign_new(sb, Ity_I32, IRExpr_Unop(Iop_1Uto32, below_max));
+    above_min = assign_new(sb, Ity_I1,
+			   IRExpr_Binop(Iop_CmpLTHWordU, tree_min, end));
+    above_min = assign_new(sb, Ity_I32, IRExpr_Unop(Iop_1Uto32, above_min));
+    both = assign_new(sb, Ity_I32,
+		      IRExpr_Binop(Iop_And32, below_max, above_min));
+    both = assign_new(sb, Ity_I32,
+		      IRExpr_Binop(Iop_And32, both,
+				   emit_page_map_test(sb, addr)));
+    return assign_new(sb, Ity_I1,
+		      IRExpr_Binop(Iop_CmpNE32, both,
+				   IRExpr_Const(IRConst_U32(0))));
+}
+
+/* Return 'guard' && 'dguard', the guard of a dirty statement. */
+static IRExpr* emit_and_guard(IRSB* sb, IRExpr* guard, IRExpr* dguard)
+{
+    IRExpr* both;
+
+    tl_assert(isIRAtom(dguard));
+    if (dguard->tag == Iex_Const && dguard->Iex.Const.con->Ico.U1)
+	return guard;
+    both = assign_new(sb, Ity_I32,
+		      IRExpr_Binop(Iop_And32,
+				   assign_new(sb, Ity_I32,
+					      IRExpr_Unop(Iop_1Uto32, guard)),
+				   assign_new(sb, Ity_I32,
+					      IRExpr_Unop(Iop_1Uto32, dguard))));
+    return assign_new(sb, Ity_I1,
+		      IRExpr_Binop(Iop_CmpNE32, both,
+				   IRExpr_Const(IRConst_U32(0))));
+}
+
+static void emit_track_call(IRSB* sb, HWord ip, IRExpr* guard,
+			    void* fn, const char* fn_name, IRExpr** argv)
+{
+    IRExpr* verdict;
+    IRExpr* cond_ex;
+    IRDirty* di = unsafeIRDirty_0_N(track_REGPARM,
+				    fn_name,
+				    VG_(fnptr_to_fnentry)(fn),
+				    argv);
+    di->guard = guard;
+    addStmtToIRSB(sb, IRStmt_Dirty(di));
+
+    /* mh_provoke_segv is stale if the call was skipped by guard */
+    verdict = assign_new(sb, Ity_I32,
+			 IRExpr_Load(Iend_Host, Ity_I32,
+				     mkIRExpr_HWord((HWord)&mh_provoke_segv)));
+    verdict = assign_new(sb, Ity_I32,
+			 IRExpr_ITE(guard, verdict,
+				    IRExpr_Const(IRConst_U32(0))));
+    cond_ex = assign_new(sb, Ity_I1, IRExpr_Unop(Iop_32to1, verdict));
+    addStmtToIRSB(sb, IRStmt_Exit(cond_ex, Ijk_SigSEGV,
+				  IRConst_HWord(ip), sb->offsIP));
+}
+
+static
+void addEvent_Dw(IRSB* sb, IRExpr* daddr, Int dsize,
+		 IRExpr* expected, /* if CAS */
+		 IRExpr* data, HWord ip)
+{
+    IRExpr**   argv;
+    IRExpr*    data64 = NULL;
+    IRExpr*    expd64;
+
+    tl_assert(isIRAtom(daddr));
+    tl_assert(dsize >= 1 && dsize <= MAX_DSIZE);
+
+    if (data && !expected
+	&& dsize > sizeof(ULong) && dsize <= MAX_STORE_DATA) {
+	/*  Vector store, emit:
+	 *
+	 *  mh_store_scratch = data;
+	 *  if (in_tree_range(daddr, dsize) && track_store_wide(daddr, dsize, cache))
+	 *      exit(SEGV);
+	 */
+	tl_assert(isIRAtom(data));
+	addStmtToIRSB(sb, IRStmt_Store(Iend_Host,
+				       mkIRExpr_HWord((HWord)mh_store_scratch),
+				       data));
+	argv = mkIRExprVec_3(daddr, mkIRExpr_HWord(dsize),
+			     mkIRExpr_HWord((HWord)site_cache(ip)));
+	emit_track_call(sb, ip, emit_range_guard(sb, daddr, dsize),
+			track_store_wide, "track_store_wide", argv);
+	return;
+    }
+
+    if (data) {
+	data64 = widen_to_U64(sb, data);
+    }
+    if (!data64) {
+	data64 = IRExpr_Const(IRConst_U64((ULong)0xdead));
+    }
+
+    if (expected) {
+	/*  Emit:
+	 *
+	 *  if (in_tree_range(daddr, dsize) && track_cas(daddr, dsize, expd, data, cache))
+	 *      exit(SEGV);
+	 */
+	expd64 = widen_to_U64(sb, expected);
+	tl_assert(expd64 != NULL);
+	argv = mkIRExprVec_5(daddr, mkIRExpr_HWord(dsize),
+			     expr2atom(sb, expd64), expr2atom(sb, data64),
+			     mkIRExpr_HWord((HWord)site_cache(ip)));
+	emit_track_call(sb, ip, emit_range_guard(sb, daddr, dsize),
+			track_cas, "track_cas", argv);
+    }
+    else {
+	/*  Emit:
+	 *
+	 *  if (in_tree_range(daddr, dsize) && track_store(daddr, dsize, data, cache))
+	 *      exit(SEGV);
+	 */
+	argv = mkIRExprVec_4(daddr, mkIRExpr_HWord(dsize), expr2atom(sb, data64),
+			     mkIRExpr_HWord((HWord)site_cache(ip)));
+	emit_track_call(sb, ip, emit_range_guard(sb, daddr, dsize),
+			track_store, "track_store", argv);
+    }
+}
+
+/* Store by dirty helper. The stored data is not known until the helper
+ * has run, so protection is checked before and the store recorded after
+ * the helper call. Neither is done if 'dguard', the guard of the dirty
+ * statement, is false.
+ */
+static void addEvent_Dw_dirty(IRSB* sb, IRExpr* daddr, Int dsize,
+			      IRExpr* dguard, HWord ip)
+{
+    IRExpr** argv;
+
+    tl_assert(isIRAtom(daddr));
+    tl_assert(dsize >= 1 && dsize <= MAX_DSIZE);
+
+    /*  Emit:
+     *
+     *  if (dguard && in_tree_range(daddr, dsize)
+     *      && track_store_check(daddr, dsize, cache))
+     *      exit(SEGV);
+     */
+    argv = mkIRExprVec_3(daddr, mkIRExpr_HWord(dsize),
+			 mkIRExpr_HWord((HWord)site_cache(ip)));
+    emit_track_call(sb, ip,
+		    emit_and_guard(sb, emit_range_guard(sb, daddr, dsize),
+				   dguard),
+		    track_store_check, "track_store_check", argv);
+}
+
+static void addEvent_Dw_dirty_done(IRSB* sb, IRExpr* daddr, Int dsize,
+				   IRExpr* dguard, HWord ip)
+{
+    IRDirty* di;
+
+    /*  Emit after the helper call:
+     *
+     *  if (dguard && in_tree_range(daddr, dsize))
+     *      track_store_done(daddr, dsize, cache);
+     */
+    di = unsafeIRDirty_0_N(track_REGPARM, "track_store_done",
+			   VG_(fnptr_to_fnentry)(track_store_done),
+			   mkIRExprVec_3(daddr, mkIRExpr_HWord(dsize),
+					 mkIRExpr_HWord((HWord)site_cache(ip))));
+    di->guard = emit_and_guard(sb, emit_range_guard(sb, daddr, dsize),
+			       dguard);
+    addStmtToIRSB(sb, IRStmt_Dirty(di));
+}
+
+static void addEvent_Dr(IRSB* sb, IRExpr* daddr, Int dsize, HWord ip)
+{
+    IRExpr**   argv;
+
+    tl_assert(isIRAtom(daddr));
+    tl_assert(dsize >= 1 && dsize <= MAX_DSIZE);
+
+    /*  Emit:
+     *
+     *  if (in_tree_range(daddr, dsize) && track_load(daddr, dsize, cache))
+     *      exit(SEGV);
+     */
+    argv = mkIRExprVec_3(daddr, mkIRExpr_HWord(dsize),
+			 mkIRExpr_HWord((HWord)site_cache(ip)));
+    emit_track_call(sb, ip, emit_range_guard(sb, daddr, dsize),
+		    track_load, "track_load", argv);
+}
+
+/* Add instructions counted since last flush to mh_instr_count.
+   Done before every exit and every track call, so that the count is
+   exact whenever it is read or the superblock is left. */
+static void flush_instr_count(IRSB* sb, UInt* pending)
+{
+    IRExpr* addr;
+    IRExpr* cnt;
+
+    if (!*pending)
+	return;
+    addr = mkIRExpr_HWord((HWord)&mh_instr_count);
+    cnt = assign_new(sb, Ity_I64, IRExpr_Load(Iend_Host, Ity_I64, addr));
+    cnt = assign_new(sb, Ity_I64,
+		     IRExpr_Binop(Iop_Add64, cnt,
+				  IRExpr_Const(IRConst_U64(*pending))));
+    addStmtToIRSB(sb, IRStmt_Store(Iend_Host, addr, cnt));
+    *pending = 0;
+}
+
+static void addEvent_Ir(IRSB* sb, HWord iaddr, UInt isize)
+{
+    IRExpr**   argv;
+
+    tl_assert(isize >= 1 && isize <= MAX_DSIZE);
+
+    /*  Only done for instructions inside NOEXE regions, see exe_protected().
+     *  Emit:
+     *
+     *  if (track_exe(iaddr, isize))
+     *      exit(SEGV);
+     */
+    argv = mkIRExprVec_2(mkIRExpr_HWord(iaddr), mkIRExpr_HWord(isize));
+    emit_track_call(sb, iaddr, IRExpr_Const(IRConst_U1(True)),
+		    track_exe, "track_exe", argv);
+}
+
+
+/* Execute protection is resolved when a superblock is translated.
+ * Only instructions inside NOEXE regions get a track_exe call and all
+ * translations of a range are discarded when its MH_EXE flag changes.
+ */
+static Bool exe_protected(Addr start, Addr end)
+{
+    struct mh_region_t* rp;
+
+    for (rp = region_lookup_min_overlap(start, end);
+	 rp && rp->start < end;
+	 rp = region_succ(rp)) {
+	if (rp->type & MH_EXE)
+	    return True;
+    }
+    return False;
+}
+
+static void exe_protection_changed(Addr start, SizeT size)
+{
+    VG_(discard_translations)((Addr64)start, (ULong)size, "memhist");
+}
+
+
+/*------------------------------------------------------------*/
+/*--- Basic tool functions                                 ---*/
+/*------------------------------------------------------------*/
+
+static void blocks_init(void);
+
+static void mh_post_clo_init(void)
+{
+    if (clo_count_instrs)
+	mh_instrumenting = True;
+    if (clo_track_alloc || clo_track_alloc_max)
+	blocks_init();
+    if (clo_false_sharing) {
+	fs_lines = VG_(HT_construct)("mh.fs_lines");
+	fs_line_pool = VG_(newPA)(sizeof(struct mh_fs_line_t), 1000,
+				  VG_(malloc), "mh.fs_line_pool", VG_(free));
+    }
+    if (clo_trace_file) {
+	trace_out = trace_open("--trace-file", clo_trace_file);
+	if (!trace_out)
+	    VG_(fmsg_bad_option)("--trace-file", "Can not create trace file\n");
+    }
+}
+
+static
+IRSB* mh_instrument(VgCallbackClosure* closure,
+		    IRSB* sbIn,
+		    VexGuestLayout* layout,
+		    VexGuestExtents* vge,
+		    VexArchInfo* arch,
+		    IRType gWordTy, IRType hWordTy)
+{
+    Int        i;
+    IRSB*      sbOut;
+    IRTypeEnv* tyenv = sbIn->tyenv;
+    HWord      currIP = 0;
+    Bool       check_exe = False;
+    UInt       n_instrs = 0;   /* not yet added to mh_instr_count */
+    IRDirty*   dirty_store;    /* dirty helper writing memory */
+
+    if (gWordTy != hWordTy) {
+	/* We don't currently support this case. */
+	VG_(tool_panic)("host/guest word size mismatch");
+    }
+
+    if (!mh_instrumenting)
+	return sbIn;
+
+    site_last_ip = 0;
+
+    if (enabled_tracking & MH_EXE) {
+	for (i = 0; i < vge->n_used; i++) {
+	    Addr base = (Addr)vge->base[i];
+	    if (exe_protected(base, base + vge->len[i]))
+		check_exe = True;
+	}
+    }
+
+    /* Set up SB */
+    sbOut = deepCopyIRSBExceptStmts(sbIn);
+
+    // Copy verbatim any IR preamble preceding the first IMark
+    i = 0;
+    while (i < sbIn->stmts_used && sbIn->stmts[i]->tag != Ist_IMark) {
+	addStmtToIRSB(sbOut, sbIn->stmts[i]);
+	i++;
+    }
+
+    for (/*use current i*/; i < sbIn->stmts_used; i++) {
+	IRStmt* st = sbIn->stmts[i];
+	if (!st || st->tag == Ist_NoOp) continue;
+
+	dirty_store = NULL;
+
+	if (clo_count_instrs) {
+	    switch (st->tag) {
+	    case Ist_IMark:
+		if (check_exe)
+		    flush_instr_count(sbOut, &n_instrs);
+		n_instrs++;
+		break;
+	    case Ist_WrTmp:
+		if ((enabled_tracking & MH_READ)
+		    && st->Ist.WrTmp.data->tag == Iex_Load)
+		    flush_instr_count(sbOut, &n_instrs);
+		break;
+	    case Ist_Store: case Ist_Dirty: case Ist_CAS: case Ist_LLSC:
+	    case Ist_Exit:
+		flush_instr_count(sbOut, &n_instrs);
+		break;
+	    default:
+		break;
+	    }
+	}
+
+	switch (st->tag) {
+	case Ist_NoOp:
+	case Ist_AbiHint:
+	case Ist_Put:
+	case Ist_PutI:
+	case Ist_MBE:
+	    break;
+
+	case Ist_IMark:
+	    /* Remember pointer to current hw instruction */
+	    currIP = (HWord)st->Ist.IMark.addr;
+
+	    if (check_exe
+		&& exe_protected(currIP, currIP + st->Ist.IMark.len)) {
+		addEvent_Ir(sbOut, currIP, st->Ist.IMark.len);
+	    }
+	    break;
+
+	case Ist_WrTmp:
+	    if (enabled_tracking & MH_READ) {
+		IRExpr* data = st->Ist.WrTmp.data;
+		if (data->tag == Iex_Load) {
+		    addEvent_Dr(sbOut, data->Iex.Load.addr,
+				sizeofIRType(data->Iex.Load.ty), currIP);
+		}
+	    }
+	    break;
+
+	case Ist_Store:
+	    if (enabled_tracking & MH_WRITE) {
+		IRExpr* data  = st->Ist.Store.data;
+		addEvent_Dw(sbOut, st->Ist.Store.addr,
+			    sizeofIRType(typeOfIRExpr(tyenv, data)),
+			    NULL,
+			    data,
+			    currIP);
+	    }
+	    break;
+
+	case Ist_StoreG:
+	    tl_assert(!"Tell Sverker he forgot to implement Ist_StoreGTo.");
+	    break;
+
+	case Ist_LoadG:
+	    tl_assert(!"Tell Sverker he forgot to implement Ist_LoadG.");
+	    break;
+
+	case Ist_Dirty: {
+	    Int      dsize;
+	    IRDirty* d = st->Ist.Dirty.details;
+	    if (d->mFx != Ifx_None) {
+		// This dirty helper accesses memory.  Collect the details.
+		tl_assert(d->mAddr != NULL);
+		tl_assert(d->mSize != 0);
+		dsize = d->mSize;
+		if ((enabled_tracking & MH_READ)
+		    && (d->mFx == Ifx_Read || d->mFx == Ifx_Modify))
+		{
+		    addEvent_Dr(sbOut, d->mAddr, dsize, currIP);
+		}
+		if ((enabled_tracking & MH_WRITE)
+		    && (d->mFx == Ifx_Write || d->mFx == Ifx_Modify))
+		{
+		    addEvent_Dw_dirty(sbOut, d->mAddr, dsize, d->guard, currIP);
+		    dirty_store = d;
+		}
+	    }
+	    else {
+		tl_assert(d->mAddr == NULL);
+		tl_assert(d->mSize == 0);
+	    }
+	    break;
+	}
+
+	case Ist_CAS: {
+	    Int    dataSize;
+	    IRCAS*  cas = st->Ist.CAS.details;
+	    IRExpr* data = cas->dataLo;
+	    IRExpr* expd = cas->expdLo;
+	    IROp mergeOp;
+	    tl_assert(cas->addr != NULL);
+	    tl_assert(cas->dataLo != NULL);
+	    dataSize = sizeofIRType(typeOfIRExpr(tyenv, cas->dataLo));
+	    tl_assert(dataSize == sizeofIRType(typeOfIRExpr(tyenv, cas->expdLo)));
+
+	    if (cas->dataHi) { /* a doubleword-CAS */
+		dataSize *= 2;
+	    }
+	    if (enabled_tracking & MH_READ) {
+		addEvent_Dr(sbOut, cas->addr, dataSize, currIP);
+	    }
+	    if (enabled_tracking & MH_WRITE) {
+		if (cas->dataHi) {  /* a doubleword-CAS */
+		    switch (dataSize) {
+		    case  2:
+			mergeOp = Iop_8HLto16;   break;
+		    case  4:
+			mergeOp = Iop_16HLto32;  break;
+		    case  8:
+			mergeOp = Iop_32HLto64;  break;
+		    default:
+			tl_assert2(0, "doubleword CAS instruction with size %u not implemented", dataSize);
+		    }
+		    data = IRExpr_Binop(mergeOp, cas->dataHi, cas->dataLo);
+		    expd = IRExpr_Binop(mergeOp, cas->expdHi, cas->expdLo);
+		}
+		addEvent_Dw(sbOut, cas->addr, dataSize, expd, data, currIP);
+	    }
+	    break;
+	}
+
+	case Ist_LLSC: {
+	    IRType dataTy;
+	    if (st->Ist.LLSC.storedata == NULL) {
+		/* LL */
+		if (enabled_tracking & MH_READ) {
+		    dataTy = typeOfIRTemp(tyenv, st->Ist.LLSC.result);
+		    addEvent_Dr(sbOut, st->Ist.LLSC.addr,
+				sizeofIRType(dataTy), currIP);
+		}
+	    }
+	    else if (enabled_tracking & MH_WRITE) {
+		/* SC */
+		dataTy = typeOfIRExpr(tyenv, st->Ist.LLSC.storedata);
+		/* Todo:
+		 * Do real *conditional* store as we do for CAS above
+		 * This is trickier to do as we don't know until *after* the
+		 * original LLSC instruction if the store really happened.
+		 */
+		addEvent_Dw(sbOut, st->Ist.LLSC.addr, sizeofIRType(dataTy),
+			    NULL, st->Ist.LLSC.storedata, currIP);
+	    }
+	    break;
+	}
+
+	case Ist_Exit:
+	    break;
+
+	default:
+	    tl_assert(0);
+	}
+	addStmtToIRSB(sbOut, st);      // Original statement
+
+	if (dirty_store)
+	    addEvent_Dw_dirty_done(sbOut, dirty_store->mAddr,
+				   dirty_store->mSize, dirty_store->guard,
+				   currIP);
+    }
+    flush_instr_count(sbOut, &n_instrs);
+
+    return sbOut;
+}
+
+static void track_mem_write(Addr addr, SizeT size, unsigned word_sz, unsigned history,
+			    const char* name)
+{
+    struct mh_region_t* rp;
+    const unsigned nwords = (size + word_sz - 1) / word_sz;
+    const unsigned nchunks = (nwords + HIST_CHUNK_WORDS - 1) / HIST_CHUNK_WORDS;
+    const unsigned data_sz = (word_sz == 1 || word_sz == 2 || word_sz == 4
+			      || word_sz == 8) ? word_sz : 0;
+
+    if (!(enabled_tracking & MH_WRITE))
+	return;
+
+    if (clo_trace_mem) {
+	VG_(umsg)("TRACE: Tracking %u-words from %p to %p with history %u\n",
+		  word_sz, (void*)addr, (void*)(addr + size), history);
+    }
+
+    rp = region_alloc(nchunks);
+    rp->start = addr;
+    rp->end = addr + size;
+    rp->name = name;
+    rp->birth_time_stamp = mh_logical_time++;
+    rp->enabled = True;
+    rp->type = MH_TRACK;
+    rp->word_sz = word_sz;
+    rp->data_sz = data_sz;
+    rp->nwords = nwords;
+    rp->history = history;
+    rp->thread_filter = MH_THREADS_ALL;
+    rp->owner = VG_INVALID_THREADID;
+    rp->threads = NULL;
+    rp->heatmap = NULL;
+    rp->changes_only = False;
+    rp->sample_rate = clo_sample_rate;
+    rp->sample_countdown = NULL;
+    rp->writes = 0;
+    if (clo_summary_heatmap || !history)
+	rp->heatmap = VG_(calloc)("mh.heatmap", 1, sizeof(struct mh_heatmap_t));
+    VG_(memset)(rp->chunk_dir, 0, nchunks * sizeof(*rp->chunk_dir));
+
+    if (trace_out)
+	trace_region(trace_out, True, rp->start, rp->end, rp->birth_time_stamp,
+		     word_sz, history, name);
+
+    insert_nonoverlapping(rp);
+}
+
+static void untrack_mem_write(Addr addr, SizeT size)
+{
+    Addr end = addr + size;
+    struct mh_region_t* rp = region_lookup_maxle(addr);
+
+    tl_assert2(rp && addr == rp->start && end == rp->end,
+	       "Could not find region to remove [%p -> %p]", addr, end);
+    tl_assert(rp->type & MH_TRACK);
+
+    if (clo_trace_mem) {
+	VG_(umsg)("TRACE: Untracking '%s' from %p to %p\n",
+		  rp->name, (void*)addr, (void*)(addr + size));
+    }
+    rp->type &= ~MH_TRACK;
+    hist_free(rp);
+    heat_free(rp);
+    fs_untrack(rp);
+    if (rp->threads) {
+	VG_(free)(rp->threads);
+	rp->threads = NULL;
+    }
+    rp->thread_filter = MH_THREADS_ALL;
+    if (rp->sample_countdown) {
+	VG_(free)(rp->sample_countdown);
+	rp->sample_countdown = NULL;
+    }
+
+    if (trace_out)
+	trace_region(trace_out, False, rp->start, rp->end, mh_logical_time,
+		     0, 0, NULL);
+
+    if (!rp->type) {
+	region_remove(rp);
+	region_free(rp);
+    }
+}
+
+static void track_able(Addr addr, SizeT size, Bool enabled)
+{
+    Addr end = addr + size;
+    struct mh_region_t* rp = region_lookup_maxle(addr);
+
+    if (!rp)
+	return;
+
+    tl_assert2(addr == rp->start && end == rp->end,
+	       "Could not find region to %sable", enabled ? "en" : "dis");
+
+    if (clo_trace_mem) {
+	VG_(umsg)("TRACE: %sable '%s' from %p to %p\n",
+		  (enabled ? "En" : "Dis"),
+		  rp->name, (void*)addr, (void*)(addr + size));
+    }
+    rp->enabled = enabled;
+}
+
+/* Set whether stores to tracked region [addr,addr+size) that leave
+   its contents unchanged are recorded */
+static void track_changes_only(Addr addr, SizeT size, Bool on)
+{
+    Addr end = addr + size;
+    struct mh_region_t* rp = region_lookup_maxle(addr);
+
+    tl_assert2(rp && addr == rp->start && end == rp->end
+	       && (rp->type & MH_TRACK),
+	       "Could not find tracked region [%p -> %p]", addr, end);
+
+    if (clo_trace_mem) {
+	VG_(umsg)("TRACE: Changes only %s for '%s' from %p to %p\n",
+		  on ? "on" : "off", rp->name, (void*)addr, (void*)end);
+    }
+    rp->changes_only = on;
+}
+
+/* Set to record one in 'rate' writes to tracked region [addr,addr+size) */
+static void track_sample_rate(Addr addr, SizeT size, UInt rate)
+{
+    Addr end = addr + size;
+    struct mh_region_t* rp = region_lookup_maxle(addr);
+
+    tl_assert2(rp && addr == rp->start && end == rp->end
+	       && (rp->type & MH_TRACK),
+	       "Could not find tracked region [%p -> %p]", addr, end);
+
+    if (clo_trace_mem) {
+	VG_(umsg)("TRACE: Sample rate %u for '%s' from %p to %p\n",
+		  rate, rp->name, (void*)addr, (void*)end);
+    }
+    rp->sample_rate = rate ? rate : 1;
+}
+
+/* Set which threads' writes are recorded in tracked region [addr,addr+size).
+   'tid' 0 means the calling thread. */
+static void track_thread_filter(ThreadId caller, Addr addr, SizeT size,
+				enum mh_thread_filter filter, ThreadId tid)
+{
+    Addr end = addr + size;
+    struct mh_region_t* rp = region_lookup_maxle(addr);
+
+    tl_assert2(rp && addr == rp->start && end == rp->end
+	       && (rp->type & MH_TRACK),
+	       "Could not find tracked region [%p -> %p] to filter", addr, end);
+    if (!tid)
+	tid = caller;
+    tl_assert2(tid < VG_N_THREADS, "Invalid thread id %u", tid);
+
+    if (clo_trace_mem) {
+	VG_(umsg)("TRACE: Thread filter %u with thread %u for '%s' from %p to %p\n",
+		  filter, tid, rp->name, (void*)addr, (void*)end);
+    }
+
+    switch (filter) {
+    case MH_THREADS_ALL:
+	if (rp->threads) {
+	    VG_(free)(rp->threads);
+	    rp->threads = NULL;
+	}
+	break;
+    case MH_THREADS_NOT_OWNER:
+	rp->owner = tid;
+	break;
+    case MH_THREADS_SET:
+	if (!rp->threads || rp->thread_filter != MH_THREADS_SET) {
+	    if (!rp->threads)
+		rp->threads = VG_(malloc)("mh.threads", (VG_N_THREADS + 7) / 8);
+	    VG_(memset)(rp->threads, 0, (VG_N_THREADS + 7) / 8);
+	}
+	rp->threads[tid / 8] |= 1 << (tid % 8);
+	break;
+    default:
+	tl_assert2(0, "Invalid thread filter %u", filter);
+    }
+    rp->thread_filter = filter;
+}
+
+
+static struct mh_region_t* alloc_region(Addr start, Addr end,
+					const char* name,
+					unsigned flags)
+{
+    struct mh_region_t* rp = region_alloc(0);
+    rp->start = start;
+    rp->end = end;
+    rp->name = name;
+    rp->birth_time_stamp = mh_logical_time++;
+    rp->enabled = True;
+    rp->type = flags;
+    rp->thread_filter = MH_THREADS_ALL;
+    rp->threads = NULL;
+    rp->heatmap = NULL;
+    rp->changes_only = False;
+    rp->sample_rate = 1;
+    rp->sample_countdown = NULL;
+    rp->writes = 0;
+    return rp;
+}
+
+static struct mh_region_t* new_region(Addr start, Addr end,
+				      const char* name,
+				      unsigned flags)
+{
+    struct mh_region_t* rp = alloc_region(start, end, name, flags);
+    insert_nonoverlapping(rp);
+    return rp;
+}
+
+static void set_mem_flags_range(Addr start, Addr end, const char* name,
+				enum mh_track_type flags);
+
+static void set_mem_flags(Addr start, SizeT size, const char* name,
+			  enum mh_track_type flags)
+{
+    Addr end = start + size;
+
+    tl_assert(flags & (MH_WRITE | MH_READ | MH_EXE));
+    tl_assert(!(flags & ~(MH_WRITE | MH_READ | MH_EXE)));
+
+    flags &= enabled_tracking;  /* ignore flags that we do not track */
+    if (!flags)
+	return;
+
+    if (clo_trace_mem) {
+	VG_(umsg)("TRACE: Set protection %s for '%s' from %p to %p\n",
+		  prot_txt(flags), name, (void*)start, (void*)end);
+    }
+
+    if (flags & MH_EXE)
+	exe_protection_changed(start, size);
+
+    set_mem_flags_range(start, end, name, flags);
+}
+
+/* Add 'flags' to [start,end), creating, extending and merging regions */
+static void set_mem_flags_range(Addr start, Addr end, const char* name,
+				enum mh_track_type flags)
+{
+    struct mh_region_t* rp;
+    enum {VOID_AT_START, REGION_AT_START } state;
+
+    rp = region_lookup_maxle(start);
+    if (rp) {
+	if (rp->end < start
+	    || (rp->end == start && rp->type != flags)) {
+	    state = VOID_AT_START;
+	    rp = region_succ(rp);
+	}
+	else {
+	    state = REGION_AT_START;
+	}
+    }
+    else {
+	state = VOID_AT_START;
+	rp = region_lookup_ming(start);
+    }
+
+    while (start < end) {
+	switch (state) {
+	case VOID_AT_START:
+	    tl_assert(!rp || rp->start > start);
+	    if (!rp || rp->start > end) {
+		new_region(start, end, name, flags);
+		return;
 	    }
-	    else if (enabled_tracking & MH_WRITE) {
-		/* SC */
-		dataTy = typeOfIRExpr(tyenv, st->Ist.LLSC.storedata);
-		/* Todo:
-		 * Do real *conditional* store as we do for CAS above
-		 * This is trickier to do as we don't know until *after* the
-		 * original LLSC instruction if the store really happened.
-		 */
-		addEvent_Dw(sbOut, st->Ist.LLSC.addr, sizeofIRType(dataTy),
-			    NULL, st->Ist.LLSC.storedata, currIP);
+	    else if (rp->type == flags) {
+		/* extent start of region */
+		region_resize(rp, start, rp->end);
+	    }
+	    else {
+		new_region(start, rp->start, name, flags);
+		start = rp->start;
 	    }
+	    state = REGION_AT_START;
 	    break;
-	}
 
-	case Ist_Exit:
+	case REGION_AT_START:
+	    tl_assert(rp && rp->start <= start && rp->end >= start);
+	    if (rp->end > end) {
+		tl_assert(rp->type & flags);
+		return;
+	    }
+	    if (rp->type == flags) {
+		struct mh_region_t* succ = region_succ(rp);
+		if (!succ || succ->start > end) {
+		    region_resize(rp, rp->start, end);
+		    return;
+		}
+		if (succ->type == flags) {
+		    Addr succ_end = succ->end;
+		    region_remove(succ);
+		    region_free(succ);
+		    region_resize(rp, rp->start, succ_end);
+		}
+		else {
+		    region_resize(rp, rp->start, succ->start);
+		    rp = succ;
+		    start = rp->start;
+		}
+		/*state = REGION_AT_START */
+	    }
+	    else {
+		rp->type |= flags;
+		if (rp->end == end) return;
+		start = rp->end;
+		rp = region_succ(rp);
+		state = (!rp || rp->start > start) ? VOID_AT_START : REGION_AT_START;
+	    }
 	    break;
+	}
+    }
+}
 
-	default:
-	    tl_assert(0);
+static void clear_mem_flags_range(Addr start, Addr end,
+				  enum mh_track_type flags);
+
+static void clear_mem_flags(Addr start, SizeT size, enum mh_track_type flags)
+{
+    Addr end = start + size;
+
+    tl_assert(flags & (MH_WRITE | MH_READ | MH_EXE));
+    tl_assert(!(flags & MH_TRACK));
+
+    flags &= enabled_tracking;  /* ignore flags that we do not track */
+    if (!flags)
+	return;
+
+    if (clo_trace_mem) {
+	VG_(umsg)("TRACE: Clear protection %s from %p to %p\n",
+		  prot_txt(flags), (void*)start, (void*)end);
+    }
+
+    if (flags & MH_EXE)
+	exe_protection_changed(start, size);
+
+    clear_mem_flags_range(start, end, flags);
+}
+
+/* Remove 'flags' from [start,end), shrinking, splitting and merging regions */
+static void clear_mem_flags_range(Addr start, Addr end,
+				  enum mh_track_type flags)
+{
+    struct mh_region_t* rp, * pred = NULL;
+
+    rp = region_lookup_maxle(start);
+    if (rp) {
+	if (rp->start < start) {
+	    if (rp->end > start) {
+		tl_assert(!(rp->type & MH_TRACK));
+
+		if (rp->type & flags) {
+		    Addr old_end = rp->end;
+		    enum mh_track_type old_flags = rp->type;
+		    enum mh_track_type new_flags = rp->type & ~flags;
+		    region_resize(rp, rp->start, start);
+		    if (old_end > end) { /* split in three */
+			if (new_flags)
+			    new_region(start, end, rp->name, new_flags);
+			new_region(end, old_end, rp->name, old_flags);
+			return;
+		    }
+		    if (new_flags) {
+			rp = new_region(start, old_end, rp->name, new_flags);
+		    }
+		}
+	    }
+	    pred = rp;
+	    rp = region_succ(rp);
 	}
-	addStmtToIRSB(sbOut, st);      // Original statement
+    }
+    else {
+	rp = region_lookup_ming(start);
     }
 
-    return sbOut;
+    while (rp && rp->start < end) {
+	if (rp->type & flags) {
+	    enum mh_track_type new_flags = rp->type & ~flags;
+	    if (rp->end > end) {
+		Addr old_end = rp->end;
+
+		tl_assert(!(rp->type & MH_TRACK));
+		if (new_flags) { /* split region */
+		    enum mh_track_type old_flags = rp->type;
+		    rp->type = new_flags;
+		    region_resize(rp, rp->start, end);
+		    new_region(end, old_end, rp->name, old_flags);
+		}
+		else { /* shrink region */
+		    region_resize(rp, end, rp->end);
+		    return;
+		}
+	    }
+	    else if (new_flags) {
+		rp->type = new_flags;
+	    }
+	    else { /* remove region */
+		pred =  rp;
+		rp = region_succ(rp);
+		region_remove(pred);
+		region_free(pred);
+		pred = NULL;
+		continue;
+	    }
+	}
+	if (pred && pred->end == rp->start
+	    && pred->type == rp->type && !(rp->type & MH_TRACK)) { /* merge regions */
+	    Addr pred_start = pred->start;
+	    region_remove(pred);
+	    region_free(pred);
+	    region_resize(rp, pred_start, rp->end);
+	}
+	pred = rp;
+	rp = region_succ(rp);
+    }
 }
 
-static unsigned align_up(unsigned unit, unsigned value)
+static Int mem_range_cmp(const void* a, const void* b)
 {
-    return ((value + unit - 1) / unit) * unit;
+    const struct vg_mem_range* x = a;
+    const struct vg_mem_range* y = b;
+
+    return x->addr < y->addr ? -1 : x->addr > y->addr;
 }
 
-static void track_mem_write(Addr addr, SizeT size, unsigned word_sz, unsigned history,
-			    const char* name)
+/* Copy 'n' client ranges, sort them and coalesce overlapping and
+   adjacent ones. Returns number of ranges left in *rangesp, to be freed
+   by caller. Empty and wrapping ranges are dropped, and no range is
+   copied if the client array is not readable. */
+static UWord copy_mem_ranges(const struct vg_mem_range* client, UWord n,
+			     struct vg_mem_range** rangesp)
 {
-    struct mh_region_t* rp;
-    const unsigned nwords = (size + word_sz - 1) / word_sz;
-    const unsigned sizeof_hist_ix_vec = nwords * sizeof(*rp->hist_ix_vec);
-    unsigned i;
-    const unsigned matrix_offset = align_up(sizeof(void*),
-					    (sizeof(struct mh_region_t)
-					     + sizeof_hist_ix_vec));
+    struct vg_mem_range* r;
+    UWord i, j;
 
-    if (!(enabled_tracking & MH_WRITE))
+    *rangesp = NULL;
+    if (!n || n > ~(UWord)0 / sizeof(*r)
+	|| !VG_(am_is_valid_for_client)((Addr)client, n * sizeof(*r),
+					VKI_PROT_READ))
+	return 0;
+    r = VG_(malloc)("mh.mem_ranges", n * sizeof(*r));
+    VG_(memcpy)(r, client, n * sizeof(*r));
+    VG_(ssort)(r, n, sizeof(*r), mem_range_cmp);
+
+    for (i = 0, j = 0; i < n; i++) {
+	if (!r[i].len || (Addr)r[i].addr + r[i].len < (Addr)r[i].addr)
+	    continue;
+	if (j && (Addr)r[j-1].addr + r[j-1].len >= (Addr)r[i].addr) {
+	    Addr end = MAX((Addr)r[j-1].addr + r[j-1].len,
+			   (Addr)r[i].addr + r[i].len);
+	    r[j-1].len = end - (Addr)r[j-1].addr;
+	}
+	else
+	    r[j++] = r[i];
+    }
+    *rangesp = r;
+    return j;
+}
+
+/* Vectored set_mem_flags. Execute protection, that discards
+   translations, is changed once for the whole span of the ranges. */
+static void set_mem_flags_vec(const struct vg_mem_range* client, UWord n,
+			      const char* name, enum mh_track_type flags)
+{
+    struct vg_mem_range* r;
+    struct mh_region_t* pred;
+    struct mh_region_t* succ;
+    Addr lo, hi;
+    UWord i;
+
+    tl_assert(flags & (MH_WRITE | MH_READ | MH_EXE));
+    tl_assert(!(flags & ~(MH_WRITE | MH_READ | MH_EXE)));
+
+    flags &= enabled_tracking;
+    if (!flags)
+	return;
+    n = copy_mem_ranges(client, n, &r);
+    if (!n)
 	return;
 
     if (clo_trace_mem) {
-	VG_(umsg)("TRACE: Tracking %u-words from %p to %p with history %u\n",
-		  word_sz, (void*)addr, (void*)(addr + size), history);
+	VG_(umsg)("TRACE: Set protection %s for '%s' on %lu ranges "
+		  "from %p to %p\n", prot_txt(flags), name, n, r[0].addr,
+		  (void*)((Addr)r[n-1].addr + r[n-1].len));
+    }
+    if (flags & MH_EXE)
+	exe_protection_changed((Addr)r[0].addr,
+			       (Addr)r[n-1].addr + r[n-1].len - (Addr)r[0].addr);
+
+    lo = (Addr)r[0].addr;
+    hi = (Addr)r[n-1].addr + r[n-1].len;
+    pred = region_lookup_maxle(lo);
+    succ = region_lookup_ming(lo);
+    if ((!pred || pred->end < lo) && (!succ || succ->start > hi)) {
+	/* Nothing to extend or merge with, typical for a batch of new
+	   guard zones. Build all regions and join them in at once. */
+	struct mh_region_t** rps = VG_(malloc)("mh.set_vec", n * sizeof(*rps));
+
+	for (i = 0; i < n; i++)
+	    rps[i] = alloc_region((Addr)r[i].addr, (Addr)r[i].addr + r[i].len,
+				  name, flags);
+	region_insert_sorted(rps, n);
+	VG_(free)(rps);
+    }
+    else {
+	for (i = 0; i < n; i++)
+	    set_mem_flags_range((Addr)r[i].addr, (Addr)r[i].addr + r[i].len,
+				name, flags);
     }
+    VG_(free)(r);
+}
 
-    rp = VG_(malloc)("track_mem_write",
-		     matrix_offset + history * nwords * sizeof(struct mh_mem_access_t));
-    rp->start = addr;
-    rp->end = addr + size;
-    rp->name = name;
-    rp->birth_time_stamp = mh_logical_time++;
-    rp->enabled = True;
-    rp->type = MH_TRACK;
-    rp->word_sz = word_sz;
-    rp->nwords = nwords;
-    rp->history = history;
-    rp->access_matrix = (struct mh_mem_access_t*)((char*)rp + matrix_offset);
-    tl_assert((char*)&rp->hist_ix_vec[nwords] <= (char*)rp->access_matrix);
-    for (i = 0; i < nwords; i++) {
-	rp->hist_ix_vec[i] = 0;
+static void clear_mem_flags_vec(const struct vg_mem_range* client, UWord n,
+				enum mh_track_type flags)
+{
+    struct vg_mem_range* r;
+    struct mh_region_t* rp;
+    Bool whole;
+    Addr lo, hi;
+    UWord i, found;
+
+    tl_assert(flags & (MH_WRITE | MH_READ | MH_EXE));
+    tl_assert(!(flags & MH_TRACK));
+
+    flags &= enabled_tracking;
+    if (!flags)
+	return;
+    n = copy_mem_ranges(client, n, &r);
+    if (!n)
+	return;
+
+    if (clo_trace_mem) {
+	VG_(umsg)("TRACE: Clear protection %s on %lu ranges from %p to %p\n",
+		  prot_txt(flags), n, r[0].addr,
+		  (void*)((Addr)r[n-1].addr + r[n-1].len));
     }
-    for (i = 0; i < history * nwords; i++) {
-	rp->access_matrix[i].call_stack = NULL;
-	rp->access_matrix[i].time_stamp = 0;
+    if (flags & MH_EXE)
+	exe_protection_changed((Addr)r[0].addr,
+			       (Addr)r[n-1].addr + r[n-1].len - (Addr)r[0].addr);
+
+    /* If every region in the span is inside one of the ranges and loses
+       all its flags, the whole span is cut out of the tree at once. */
+    lo = (Addr)r[0].addr;
+    hi = (Addr)r[n-1].addr + r[n-1].len;
+    whole = True;
+    i = found = 0;
+    for (rp = region_lookup_min_overlap(lo, hi);
+	 rp && rp->start < hi;
+	 rp = region_succ(rp)) {
+	while ((Addr)r[i].addr + r[i].len <= rp->start)
+	    i++;
+	if (rp->start < (Addr)r[i].addr
+	    || rp->end > (Addr)r[i].addr + r[i].len
+	    || (rp->type & ~flags)) {
+	    whole = False;
+	    break;
+	}
+	found++;
     }
 
-    insert_nonoverlapping(rp);
+    if (whole) {
+	if (found)
+	    region_remove_all(lo, hi);
+    }
+    else {
+	for (i = 0; i < n; i++)
+	    clear_mem_flags_range((Addr)r[i].addr, (Addr)r[i].addr + r[i].len,
+				  flags);
+    }
+    VG_(free)(r);
 }
 
-static void untrack_mem_write(Addr addr, SizeT size)
+
+/*------------------------------------------------------------*/
+/*--- Heap block tracking                                  ---*/
+/*------------------------------------------------------------*/
+
+/* The client's malloc and friends are always replaced by Valgrind's
+   allocator, as the tool can not turn on replacement only when asked.
+
+   With --track-alloc or --track-alloc-size, all client heap blocks are
+   kept in mh_blocks for their size at free and realloc. Blocks selected
+   by the options are tracked as regions from allocation until they are
+   freed. Without the options mh_blocks is NULL and nothing is kept. */
+struct mh_block_t {
+    struct mh_block_t* next;  /* VgHashNode */
+    Addr addr;                /* VgHashNode key */
+    SizeT size;
+    Bool tracked;
+};
+
+static VgHashTable mh_blocks = NULL;
+static PoolAlloc* block_pool = NULL;
+static ULong stat_blocks_tracked = 0;
+
+static void blocks_init(void)
 {
-    Addr end = addr + size;
-    struct mh_region_t* rp = region_lookup_maxle(addr);
+    mh_blocks = VG_(HT_construct)("mh.blocks");
+    block_pool = VG_(newPA)(sizeof(struct mh_block_t), 1000,
+			    VG_(malloc), "mh.block_pool", VG_(free));
+}
 
-    tl_assert2(rp && addr == rp->start && end == rp->end,
-	       "Could not find region to remove [%p -> %p]", addr, end);
-    tl_assert(rp->type & MH_TRACK);
+/* Whether function at 'ip' matches --track-alloc, and whether it is
+   "main". Lookups of function names are slow, so results are cached per
+   ip. Addresses without a name are not cached, as code may be loaded
+   there later. */
+#define ALLOC_IP_CACHE_SIZE 4096
+#define ALLOC_STACK_DEPTH   64   /* max frames searched, --num-callers */
 
-    if (clo_trace_mem) {
-	VG_(umsg)("TRACE: Untracking '%s' from %p to %p\n",
-		  rp->name, (void*)addr, (void*)(addr + size));
+static Bool alloc_ip_matches(Addr ip, Bool* is_main)
+{
+    static struct {
+	Addr ip;
+	Bool match;
+	Bool is_main;
+    } cache[ALLOC_IP_CACHE_SIZE];
+    HChar fnname[256];
+    unsigned ix = (ip >> 2) % ALLOC_IP_CACHE_SIZE;
+
+    if (cache[ix].ip != ip) {
+	if (!VG_(get_fnname)(ip, fnname, sizeof(fnname))) {
+	    *is_main = False;
+	    return False;
+	}
+	cache[ix].ip = ip;
+	cache[ix].match = VG_(string_match)(clo_track_alloc, fnname);
+	cache[ix].is_main = VG_(get_fnname_kind)(fnname) == Vg_FnNameMain;
     }
-    rp->type &= ~MH_TRACK;
+    *is_main = cache[ix].is_main;
+    return cache[ix].match;
+}
 
-    if (!rp->type) {
-	region_remove(rp);
-	VG_(free)(rp);
+/* Region name of a new block, or NULL if it should not be tracked */
+static const char* alloc_selected(ThreadId tid, SizeT size)
+{
+    if (clo_track_alloc_max
+	&& size >= clo_track_alloc_min && size <= clo_track_alloc_max)
+	return "heap block";
+
+    if (clo_track_alloc) {
+	Addr ips[ALLOC_STACK_DEPTH];
+	UInt i, n_ips = VG_(get_StackTrace)(tid, ips,
+					    MIN(VG_(clo_backtrace_size),
+						ALLOC_STACK_DEPTH),
+					    NULL, NULL, 0);
+	Bool is_main;
+
+	/* Frames below main are not searched, like they are not shown in
+	   error reports. Without unwind info for them they may be junk. */
+	for (i = 0; i < n_ips; i++) {
+	    if (alloc_ip_matches(ips[i], &is_main))
+		return clo_track_alloc;
+	    if (is_main && !VG_(clo_show_below_main))
+		break;
+	}
     }
+    return NULL;
 }
 
-static void track_able(Addr addr, SizeT size, Bool enabled)
+static void* new_block(ThreadId tid, SizeT size, SizeT align, Bool is_zeroed)
 {
-    Addr end = addr + size;
-    struct mh_region_t* rp = region_lookup_maxle(addr);
+    struct mh_block_t* bp;
+    const char* name;
+    void* p = VG_(cli_malloc)(align, size);
+
+    if (!p)
+	return NULL;
+    if (is_zeroed)
+	VG_(memset)(p, 0, size);
+    if (!mh_blocks)
+	return p;
+
+    bp = VG_(allocEltPA)(block_pool);
+    bp->addr = (Addr)p;
+    bp->size = size;
+    bp->tracked = False;
+    VG_(HT_add_node)(mh_blocks, bp);
+
+    /* Leave blocks alone that the client already tracks or protects */
+    if (size && (enabled_tracking & MH_WRITE)
+	&& (name = alloc_selected(tid, size)) != NULL
+	&& !region_lookup_min_overlap(bp->addr, bp->addr + size)) {
+	track_mem_write(bp->addr, size, sizeof(UWord),
+			clo_track_alloc_history, name);
+	bp->tracked = True;
+	stat_blocks_tracked++;
+    }
+    return p;
+}
 
-    if (!rp)
+static void die_block(void* p)
+{
+    struct mh_block_t* bp;
+
+    if (!mh_blocks) {
+	VG_(cli_free)(p);
+	return;
+    }
+    bp = VG_(HT_remove)(mh_blocks, (UWord)p);
+    if (!bp)
 	return;
+    if (bp->tracked) {
+	/* unless already untracked by the client */
+	struct mh_region_t* rp = region_lookup_maxle(bp->addr);
+	if (rp && rp->start == bp->addr && rp->end == bp->addr + bp->size
+	    && (rp->type & MH_TRACK))
+	    untrack_mem_write(bp->addr, bp->size);
+    }
+    VG_(cli_free)(p);
+    VG_(freeEltPA)(block_pool, bp);
+}
 
-    tl_assert2(addr == rp->start && end == rp->end,
-	       "Could not find region to %sable", enabled ? "en" : "dis");
+static void* mh_malloc(ThreadId tid, SizeT size)
+{
+    return new_block(tid, size, VG_(clo_alignment), False);
+}
 
-    if (clo_trace_mem) {
-	VG_(umsg)("TRACE: %sable '%s' from %p to %p\n",
-		  (enabled ? "En" : "Dis"),
-		  rp->name, (void*)addr, (void*)(addr + size));
+static void* mh___builtin_new(ThreadId tid, SizeT size)
+{
+    return new_block(tid, size, VG_(clo_alignment), False);
+}
+
+static void* mh___builtin_vec_new(ThreadId tid, SizeT size)
+{
+    return new_block(tid, size, VG_(clo_alignment), False);
+}
+
+static void* mh_calloc(ThreadId tid, SizeT nmemb, SizeT size1)
+{
+    return new_block(tid, nmemb * size1, VG_(clo_alignment), True);
+}
+
+static void* mh_memalign(ThreadId tid, SizeT align, SizeT size)
+{
+    return new_block(tid, size, align, False);
+}
+
+static SizeT mh_malloc_usable_size(ThreadId tid, void* p)
+{
+    struct mh_block_t* bp;
+
+    if (!mh_blocks)
+	return VG_(malloc_usable_size)(p);
+    bp = VG_(HT_lookup)(mh_blocks, (UWord)p);
+    return bp ? bp->size : 0;
+}
+
+static void mh_free(ThreadId tid, void* p)
+{
+    die_block(p);
+}
+
+static void mh___builtin_delete(ThreadId tid, void* p)
+{
+    die_block(p);
+}
+
+static void mh___builtin_vec_delete(ThreadId tid, void* p)
+{
+    die_block(p);
+}
+
+static void* mh_realloc(ThreadId tid, void* p_old, SizeT new_size)
+{
+    SizeT old_size;
+    void* p_new;
+
+    if (!p_old)
+	return mh_malloc(tid, new_size);
+    if (!new_size) {
+	die_block(p_old);
+	return NULL;
     }
-    rp->enabled = enabled;
+    old_size = mh_malloc_usable_size(tid, p_old);
+    if (!old_size)
+	return NULL;
+
+    /* Always move, the new block is selected by the realloc stack */
+    p_new = new_block(tid, new_size, VG_(clo_alignment), False);
+    if (p_new) {
+	VG_(memcpy)(p_new, p_old, MIN(old_size, new_size));
+	die_block(p_old);
+    }
+    return p_new;
 }
 
 
-static struct mh_region_t* new_region(Addr start, Addr end,
-				      const char* name,
-				      unsigned flags)
+/*------------------------------------------------------------*/
+/*--- Client requests                                      ---*/
+/*------------------------------------------------------------*/
+
+static void print_word(unsigned word_sz, ULong data)
 {
-    struct mh_region_t* rp;
-    rp = VG_(malloc)("set_mem_readonly", sizeof(struct mh_region_t));
-    rp->start = start;
-    rp->end = end;
-    rp->name = name;
-    rp->birth_time_stamp = mh_logical_time++;
-    rp->enabled = True;
-    rp->type = flags;
-    insert_nonoverlapping(rp);
-    return rp;
+    switch (word_sz) {
+#if VEX_HOST_WORDSIZE == 8
+    case sizeof(HWord):
+	VG_(umsg)("%p", (void*)(HWord)data);
+	break;
+#endif
+    case sizeof(int):
+	VG_(umsg)("%#x", (int)data); break;
+    case sizeof(short):
+	VG_(umsg)("%#x", (int)(short)data); break;
+    case sizeof(char):
+	VG_(umsg)("%#x", (int)(char)data); break;
+    default:
+	VG_(umsg)("(?)"); break;
+    }
 }
 
-static void set_mem_flags(Addr start, SizeT size, const char* name,
-			  enum mh_track_type flags)
+/* Print history of all words of tracked region 'rp' that overlap
+   [start,end), newest write first. */
+static void print_history(struct mh_region_t* rp, Addr start, Addr end)
 {
-    Addr end = start + size;
-    struct mh_region_t* rp;
-    enum {VOID_AT_START, REGION_AT_START } state;
-
-    tl_assert(flags & (MH_WRITE | MH_READ | MH_EXE));
-    tl_assert(!(flags & ~(MH_WRITE | MH_READ | MH_EXE)));
+    unsigned wix; /* word index */
+    unsigned end_wix;
+    Addr addr;
 
-    flags &= enabled_tracking;  /* ignore flags that we do not track */
-    if (!flags)
+    tl_assert(rp->type & MH_TRACK);
+    start = MAX(start, rp->start);
+    end = MIN(end, rp->end);
+    if (start >= end)
 	return;
+    wix = (start - rp->start) / rp->word_sz;
+    end_wix = (end - rp->start - 1) / rp->word_sz + 1;
 
-    if (clo_trace_mem) {
-	VG_(umsg)("TRACE: Set protection %s for '%s' from %p to %p\n",
-		  prot_txt(flags), name, (void*)start, (void*)end);
-    }
-
-    rp = region_lookup_maxle(start);
-    if (rp) {
-	if (rp->end < start
-	    || (rp->end == start && rp->type != flags)) {
-	    state = VOID_AT_START;
-	    rp = region_succ(rp);
+    for (addr = rp->start + (Addr)wix * rp->word_sz; wix < end_wix;
+	 wix++, addr += rp->word_sz) {
+	struct mh_hist_chunk_t* cp = rp->chunk_dir[wix / HIST_CHUNK_WORDS];
+	unsigned cwix = wix % HIST_CHUNK_WORDS;
+	unsigned h;
+	int hist_ix;
+
+	if (!cp) {
+	    /* Skip all following never written chunks */
+	    unsigned skip_wix = wix;
+	    Addr skip_end;
+	    do {
+		skip_wix += HIST_CHUNK_WORDS - skip_wix % HIST_CHUNK_WORDS;
+	    } while (skip_wix < end_wix
+		     && !rp->chunk_dir[skip_wix / HIST_CHUNK_WORDS]);
+	    skip_wix = MIN(skip_wix, end_wix);
+	    skip_end = MIN(rp->start + (Addr)skip_wix * rp->word_sz, rp->end);
+	    VG_(umsg)("%u-bytes from %p to %p not written.\n",
+		      rp->word_sz, (void*)addr, (void*)skip_end);
+	    wix = skip_wix - 1;
+	    addr = rp->start + (Addr)wix * rp->word_sz;
+	    continue;
 	}
-	else {
-	    state = REGION_AT_START;
-	}
-    }
-    else {
-	state = VOID_AT_START;
-	rp = region_lookup_ming(start);
-    }
 
-    while (start < end) {
-	switch (state) {
-	case VOID_AT_START:
-	    tl_assert(!rp || rp->start > start);
-	    if (!rp || rp->start > end) {
-		new_region(start, end, name, flags);
-		return;
-	    }
-	    else if (rp->type == flags) {
-		/* extent start of region */
-		rp->start = start;
-		node_updated(rp);
-	    }
-	    else {
-		new_region(start, rp->start, name, flags);
-		start = rp->start;
-	    }
-	    state = REGION_AT_START;
-	    break;
+	hist_ix = cp->hist_ix_vec[cwix] - 1;
 
-	case REGION_AT_START:
-	    tl_assert(rp && rp->start <= start && rp->end >= start);
-	    if (rp->end > end) {
-		tl_assert(rp->type & flags);
-		return;
-	    }
-	    if (rp->type == flags) {
-		struct mh_region_t* succ = region_succ(rp);
-		if (!succ || succ->start > end) {
-		    rp->end = end;
-		    node_updated(rp);
-		    return;
-		}
-		if (succ->type == flags) {
-		    Addr succ_end = succ->end;
-		    region_remove(succ);
-		    VG_(free)(succ);
-		    rp->end = succ_end;
-		    node_updated(rp);
+	for (h = 0; h < rp->history; h++, hist_ix--) {
+	    unsigned i;
+
+	    if (hist_ix < 0) hist_ix = rp->history - 1;
+
+	    //VG_(umsg)("TRACE: Reading at ix=%u\n", wix*rp->history + hist_ix);
+	    i = hist_ix * hist_chunk_nwords(rp, wix / HIST_CHUNK_WORDS) + cwix;
+	    if (cp->ecu[i]) {
+		if (!h) {
+		    VG_(umsg)("%u-bytes ", rp->word_sz);
+		    print_word(rp->word_sz, hist_get_data(rp, cp, i));
+		    VG_(umsg)(" written to address %p by thread %u at time %llu",
+			      (void*)addr, cp->tid[i], cp->time[i]);
 		}
 		else {
-		    rp->end = succ->start;
-		    node_updated(rp);
-		    rp = succ;
-		    start = rp->start;
+		    VG_(umsg)("       AND ");
+		    print_word(rp->word_sz, hist_get_data(rp, cp, i));
+		    VG_(umsg)(" written by thread %u at time %llu",
+			      cp->tid[i], cp->time[i]);
 		}
-		/*state = REGION_AT_START */
+		if (cp->icount)
+		    VG_(umsg)(" after %llu instructions", cp->icount[i]);
+		VG_(umsg)(":\n");
+		VG_(pp_ExeContext)(stack_to_exe_context(cp->ecu[i]));
 	    }
 	    else {
-		rp->type |= flags;
-		if (rp->end == end) return;
-		start = rp->end;
-		rp = region_succ(rp);
-		state = (!rp || rp->start > start) ? VOID_AT_START : REGION_AT_START;
+		if (!h) VG_(umsg)("%u-bytes at %p not written.\n", rp->word_sz, (void*)addr);
+		break;
 	    }
-	    break;
 	}
     }
 }
 
-static void clear_mem_flags(Addr start, SizeT size, enum mh_track_type flags)
+/* Print history of all tracked regions overlapping [addr,addr+len),
+   or write counts for regions in heatmap mode */
+static void print_range_history(Addr addr, SizeT len)
 {
-    Addr end = start + size;
-    struct mh_region_t* rp, * pred = NULL;
+    Addr end = addr + len;
+    struct mh_region_t* rp = region_lookup_min_overlap(addr, end);
+    Bool found = False;
+
+    for ( ; rp && rp->start < end; rp = region_succ(rp)) {
+	if (!(rp->type & MH_TRACK))
+	    continue;
+	if (rp->heatmap) {
+	    VG_(umsg)("Region '%s' from %p to %p with word size %u "
+		      "in heatmap mode:\n", rp->name,
+		      (void*)rp->start, (void*)rp->end, rp->word_sz);
+	    print_heatmap(rp, addr, end);
+	}
+	else {
+	    VG_(umsg)("Region '%s' from %p to %p with word size %u "
+		      "and history %u:\n", rp->name,
+		      (void*)rp->start, (void*)rp->end, rp->word_sz,
+		      rp->history);
+	    print_history(rp, addr, end);
+	}
+	found = True;
+    }
+    if (!found)
+	VG_(umsg)("No tracked region from %p to %p.\n",
+		  (void*)addr, (void*)end);
+}
 
-    tl_assert(flags & (MH_WRITE | MH_READ));
-    tl_assert(!(flags & MH_TRACK));
+/* Copy call stack of last recorded write to the word at 'addr' into
+   'ips', at most 'max_ips' entries. Returns number of entries copied,
+   0 if 'addr' is not tracked or not written, its region is in heatmap
+   mode or 'ips' is not writable client memory. */
+static UInt last_writer(Addr addr, Addr* ips, UInt max_ips)
+{
+    struct mh_region_t* rp = region_lookup_min_overlap(addr, addr + 1);
+    struct mh_hist_chunk_t* cp;
+    unsigned wix, cwix, hix, i;
+    ExeContext* ec;
+    StackTrace st;
+    UInt n;
+
+    if (!rp || !(rp->type & MH_TRACK))
+	return 0;
+    wix = (addr - rp->start) / rp->word_sz;
+    cp = rp->chunk_dir[wix / HIST_CHUNK_WORDS];
+    if (!cp)
+	return 0;
+    cwix = wix % HIST_CHUNK_WORDS;
+    hix = cp->hist_ix_vec[cwix];
+    hix = (hix ? hix : rp->history) - 1;
+    i = hix * hist_chunk_nwords(rp, wix / HIST_CHUNK_WORDS) + cwix;
+    if (!cp->ecu[i])
+	return 0;
 
-    flags &= enabled_tracking;  /* ignore flags that we do not track */
-    if (!flags)
-	return;
+    ec = stack_to_exe_context(cp->ecu[i]);
+    st = VG_(get_ExeContext_StackTrace)(ec);
+    n = MIN(VG_(get_ExeContext_n_ips)(ec), max_ips);
+    if (!VG_(am_is_valid_for_client)((Addr)ips, n * sizeof(Addr),
+				     VKI_PROT_WRITE))
+	return 0;
+    VG_(memcpy)(ips, st, n * sizeof(Addr));
+    return n;
+}
 
-    if (clo_trace_mem) {
-	VG_(umsg)("TRACE: Clear protection %s from %p to %p\n",
-		  prot_txt(flags), (void*)start, (void*)end);
-    }
+/*------------------------------------------------------------*/
+/*--- gdbserver monitor commands                           ---*/
+/*------------------------------------------------------------*/
 
-    rp = region_lookup_maxle(start);
-    if (rp) {
-	if (rp->start < start) {
-	    if (rp->end > start) {
-		tl_assert(!(rp->type & MH_TRACK));
+static void print_monitor_help(void)
+{
+    VG_(gdb_printf)
+	(
+"\n"
+"memhist monitor commands:\n"
+"  who_wrote <addr> [<len>]\n"
+"        shows recorded writes to <len> (or 1) bytes at <addr>\n"
+"  regions\n"
+"        lists all tracked and protected regions\n"
+"  stats\n"
+"        shows statistics about recorded history\n"
+"\n");
+}
 
-		if (rp->type & flags) {
-		    Addr old_end = rp->end;
-		    enum mh_track_type new_flags = rp->type & ~flags;
-		    rp->end = start;
-		    node_updated(rp);
-		    if (new_flags) {
-			rp = new_region(start, old_end, rp->name, new_flags);
-		    }
-		}
-	    }
-	    pred = rp;
-	    rp = region_succ(rp);
+static void monitor_regions(void)
+{
+    struct mh_region_t* rp;
+
+    for (rp = region_min(); rp; rp = region_succ(rp)) {
+	if (rp->type & MH_TRACK) {
+	    unsigned cix, written = 0;
+	    for (cix = 0; cix < rp->nchunks; cix++)
+		written += rp->chunk_dir[cix] != NULL;
+	    VG_(umsg)("Tracking '%s' from %p to %p with word size %u, "
+		      "history %u, %u of %u chunks written%s.\n",
+		      rp->name, (void*)rp->start, (void*)rp->end,
+		      rp->word_sz, rp->history, written, rp->nchunks,
+		      rp->enabled ? "" : ", disabled");
+	    VG_(umsg)("  %llu writes, one in %u recorded.\n",
+		      rp->writes, rp->sample_rate);
+	}
+	if (rp->type & (MH_WRITE | MH_READ | MH_EXE)) {
+	    VG_(umsg)("Region '%s' set as %s from %p to %p.\n",
+		      rp->name, prot_txt(rp->type),
+		      (void*)rp->start, (void*)rp->end);
 	}
     }
-    else {
-	rp = region_lookup_ming(start);
-    }
+}
 
-    while (rp && rp->start < end) {
-	if (rp->type & flags) {
-	    enum mh_track_type new_flags = rp->type & ~flags;
-	    if (rp->end > end) {
-		Addr old_end = rp->end;
+static void monitor_stats(void)
+{
+    struct mh_region_t* rp;
+    unsigned nregions = 0, ntracked = 0;
+    ULong tracked_bytes = 0;
 
-		tl_assert(!(rp->type & MH_TRACK));
-		if (new_flags) { /* split region */
-		    rp->type = new_flags;
-		    rp->end = end;
-		    node_updated(rp);
-		    new_region(end, old_end, rp->name, new_flags);
-		}
-		else { /* shrink region */
-		    rp->start = end;
-		    node_updated(rp);
-		    return;
-		}
-	    }
-	    else if (new_flags) {
-		rp->type = new_flags;
-	    }
-	    else { /* remove region */
-		pred =  rp;
-		rp = region_succ(rp);
-		region_remove(pred);
-		pred = NULL;
-		continue;
-	    }
-	}
-	if (pred && pred->end == rp->start
-	    && pred->type == rp->type && !(rp->type & MH_TRACK)) { /* merge regions */
-	    Addr pred_start = pred->start;
-	    region_remove(pred);
-	    rp->start = pred_start;
-	    node_updated(rp);
+    for (rp = region_min(); rp; rp = region_succ(rp)) {
+	nregions++;
+	if (rp->type & MH_TRACK) {
+	    ntracked++;
+	    tracked_bytes += rp->end - rp->start;
 	}
-	pred = rp;
-	rp = region_succ(rp);
     }
+    VG_(umsg)("Regions: %u, of which %u tracked covering %llu bytes.\n",
+	      nregions, ntracked, tracked_bytes);
+    VG_(umsg)("History: %llu chunks using %llu bytes.\n",
+	      stat_hist_chunks, stat_hist_bytes);
+    VG_(umsg)("Stores recorded: %llu, logical time: %llu.\n",
+	      stat_stores, mh_logical_time);
+    VG_(umsg)("Silent stores skipped: %llu.\n", stat_silent_stores);
+    if (mh_blocks) {
+	VG_(umsg)("Heap blocks: %d live, %llu tracked since start.\n",
+		  VG_(HT_count_nodes)(mh_blocks), stat_blocks_tracked);
+    }
+    VG_(umsg)("Lookup index: %s, %lu regions, built %llu times.\n",
+	      ix_gen == mh_region_gen ? "valid" : "stale", ix_n, stat_ix_builds);
+    VG_(umsg)("Instrumenting: %s.\n", mh_instrumenting ? "yes" : "no");
 }
 
+static Bool handle_gdb_monitor_command(ThreadId tid, HChar* req)
+{
+    HChar* wcmd;
+    HChar s[VG_(strlen)(req) + 1]; /* copy for strtok_r */
+    HChar* ssaveptr;
+
+    VG_(strcpy)(s, req);
+
+    wcmd = VG_(strtok_r)(s, " ", &ssaveptr);
+    switch (VG_(keyword_id)("help who_wrote regions stats",
+			    wcmd, kwd_report_duplicated_matches)) {
+    case -2: /* multiple matches */
+	return True;
+    case -1: /* not found */
+	return False;
+    case 0: /* help */
+	print_monitor_help();
+	return True;
+    case 1: { /* who_wrote */
+	Addr address;
+	SizeT szB = 1;
+	VG_(strtok_get_address_and_size)(&address, &szB, &ssaveptr);
+	if (szB != 0)
+	    print_range_history(address, szB);
+	return True;
+    }
+    case 2: /* regions */
+	monitor_regions();
+	return True;
+    case 3: /* stats */
+	monitor_stats();
+	return True;
+    default:
+	tl_assert(0);
+	return False;
+    }
+}
 
-/*------------------------------------------------------------*/
-/*--- Client requests                                      ---*/
-/*------------------------------------------------------------*/
+/* Is there a readable, NUL terminated string at client address 's'? */
+static Bool is_client_string(Addr s)
+{
+    const Addr start = s;
+
+    for (;; s++) {
+	if ((s == start || VG_IS_PAGE_ALIGNED(s))
+	    && !VG_(am_is_valid_for_client)(VG_PGROUNDDN(s), VKI_PAGE_SIZE,
+					    VKI_PROT_READ))
+	    return False;
+	if (*(HChar*)s == '\0')
+	    return True;
+    }
+}
 
 static Bool mh_handle_client_request(ThreadId tid, UWord* arg, UWord* ret)
 {
-    if (!VG_IS_TOOL_USERREQ('M', 'H', arg[0])) {
+    if (!VG_IS_TOOL_USERREQ('M', 'H', arg[0])
+	&& VG_USERREQ__GDB_MONITOR_COMMAND != arg[0]) {
 	return False;
     }
 
@@ -1173,6 +4042,18 @@ static Bool mh_handle_client_request(ThreadId tid, UWord* arg, UWord* ret)
 	*ret = -1;
 	break;
 
+    case VG_USERREQ__SET_PROTECTION_VEC:
+	set_mem_flags_vec((const struct vg_mem_range*)arg[1], arg[2],
+			  (char*)arg[3], (enum mh_track_type)arg[4]);
+	*ret = -1;
+	break;
+
+    case VG_USERREQ__CLEAR_PROTECTION_VEC:
+	clear_mem_flags_vec((const struct vg_mem_range*)arg[1], arg[2],
+			    (enum mh_track_type)arg[3]);
+	*ret = -1;
+	break;
+
     case VG_USERREQ__DISABLE_PROTECTION:
 	protection_disable_counter++;
 	break;
@@ -1183,6 +4064,44 @@ static Bool mh_handle_client_request(ThreadId tid, UWord* arg, UWord* ret)
 	protection_disable_counter--;
 	break;
 
+    case VG_USERREQ__TRACK_THREAD_FILTER:
+	track_thread_filter(tid, arg[1], arg[2],
+			    (enum mh_thread_filter)arg[3], arg[4]);
+	*ret = -1;
+	break;
+
+    case VG_USERREQ__TRACK_CHANGES_ONLY:
+	track_changes_only(arg[1], arg[2], arg[3] != 0);
+	*ret = -1;
+	break;
+
+    case VG_USERREQ__TRACK_SAMPLE_RATE:
+	track_sample_rate(arg[1], arg[2], arg[3]);
+	*ret = -1;
+	break;
+
+    case VG_USERREQ__DUMP_HISTORY_FILE:
+	if (arg[1] && is_client_string(arg[1]))
+	    *ret = dump_history(NULL, (HChar*)arg[1]);
+	else
+	    *ret = 0;
+	break;
+
+    case VG_USERREQ__DUMP_HISTORY:
+	print_range_history(arg[1], arg[2]);
+	*ret = 0;
+	break;
+
+    case VG_USERREQ__LAST_WRITER:
+	*ret = last_writer(arg[1], (Addr*)arg[2], arg[3]);
+	break;
+
+    case VG_USERREQ__GDB_MONITOR_COMMAND: {
+	Bool handled = handle_gdb_monitor_command(tid, (HChar*)arg[1]);
+	*ret = handled;
+	return handled;
+    }
+
     default:
 	VG_(message)(
 	    Vg_UserMsg,
@@ -1195,68 +4114,31 @@ static Bool mh_handle_client_request(ThreadId tid, UWord* arg, UWord* ret)
 }
 
 
-static void print_word(unsigned word_sz, struct mh_mem_access_t* ap)
-{
-    switch (word_sz) {
-#if VEX_HOST_WORDSIZE == 8
-    case sizeof(HWord):
-	VG_(umsg)("%p", (void*)ap->data);
-	break;
-#endif
-    case sizeof(int):
-	VG_(umsg)("%#x", (int)ap->data); break;
-    case sizeof(short):
-	VG_(umsg)("%#x", (int)(short)ap->data); break;
-    case sizeof(char):
-	VG_(umsg)("%#x", (int)(char)ap->data); break;
-    default:
-	VG_(umsg)("(?)"); break;
-    }
-}
-
-
 static void mh_fini(Int exitcode)
 {
     struct mh_region_t* rp = region_min();
 
+    if (trace_out) {
+	trace_close(trace_out);
+	trace_out = NULL;
+    }
+    if (clo_dump_file)
+	dump_history("--dump-file", clo_dump_file);
+
     for (rp = region_min(); rp; rp = region_succ(rp)) {
-	if (rp->type & MH_TRACK) {
-	    unsigned wix = 0; /* word index */
-	    Addr addr = rp->start;
+	if ((rp->type & MH_TRACK) && clo_dump_at_exit) {
 	    VG_(umsg)("Memhist tracking '%s' from %p to %p with word size %u "
-		      "and history %u created at time %u.\n", rp->name,
+		      "and history %u created at time %llu.\n", rp->name,
 		      (void*)rp->start, (void*)rp->end, rp->word_sz,
 		      rp->history, rp->birth_time_stamp);
-	    for (addr = rp->start; addr < rp->end; wix++, addr += rp->word_sz) {
-		unsigned h;
-		int hist_ix = rp->hist_ix_vec[wix] - 1;
-
-		for (h = 0; h < rp->history; h++, hist_ix--) {
-		    struct mh_mem_access_t* ap;
-
-		    if (hist_ix < 0) hist_ix = rp->history - 1;
-
-		    //VG_(umsg)("TRACE: Reading at ix=%u\n", wix*rp->history + hist_ix);
-		    ap = &rp->access_matrix[wix * rp->history + hist_ix];
-		    if (ap->call_stack) {
-			if (!h) {
-			    VG_(umsg)("%u-bytes ", rp->word_sz);
-			    print_word(rp->word_sz, ap);
-			    VG_(umsg)(" written to address %p at time %u:\n",
-				      (void*)addr, ap->time_stamp);
-			}
-			else {
-			    VG_(umsg)("       AND ");
-			    print_word(rp->word_sz, ap);
-			    VG_(umsg)(" written at time %u:\n", ap->time_stamp);
-			}
-			VG_(pp_ExeContext)(ap->call_stack);
-		    }
-		    else {
-			if (!h) VG_(umsg)("%u-bytes at %p not written.\n", rp->word_sz, (void*)addr);
-			break;
-		    }
+	    if (rp->heatmap)
+		print_heatmap(rp, rp->start, rp->end);
+	    else {
+		if (rp->sample_rate > 1) {
+		    VG_(umsg)("%llu writes, one in %u recorded.\n",
+			      rp->writes, rp->sample_rate);
 		}
+		print_history(rp, rp->start, rp->end);
 	    }
 	}
 	if (rp->type & MH_WRITE) {
@@ -1265,6 +4147,8 @@ static void mh_fini(Int exitcode)
 		      (void*)rp->start, (void*)rp->end);
 	}
     }
+    if (clo_false_sharing)
+	fs_print_report();
 #ifdef MH_DEBUG
     VG_(umsg)("Tree lookup steps     = %u.\n", tree_lookup_steps);
     VG_(umsg)("Tree lookup shortcuts = %u.\n", tree_shortcuts);
@@ -1275,6 +4159,7 @@ static void mh_pre_clo_init(void)
 {
     rb_tree_init(&region_tree, region_cmp, region_cmp_key,
 		 update_subtree, region_print);
+    pm_init();
 
     VG_(details_name)("Memhist");
     VG_(details_version)(NULL);
@@ -1291,6 +4176,22 @@ static void mh_pre_clo_init(void)
 				    mh_print_usage,
 				    mh_print_debug_usage);
     VG_(needs_client_requests)(mh_handle_client_request);
+    VG_(needs_malloc_replacement)(mh_malloc,
+				  mh___builtin_new,
+				  mh___builtin_vec_new,
+				  mh_memalign,
+				  mh_calloc,
+				  mh_free,
+				  mh___builtin_delete,
+				  mh___builtin_vec_delete,
+				  mh_realloc,
+				  mh_malloc_usable_size,
+				  0);
+    mh_sites = VG_(HT_construct)("mh.sites");
+    site_pool = VG_(newPA)(sizeof(struct mh_site_t), 1000,
+			   VG_(malloc), "mh.site_pool", VG_(free));
+
+    VG_(track_start_client_code)(mh_start_client_code);
 }
 
 VG_DETERMINE_INTERFACE_VERSION(mh_pre_clo_init)
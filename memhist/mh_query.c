@@ -0,0 +1,708 @@
+/*--------------------------------------------------------------------*/
+/*--- mh_query: query a memhist binary trace or dump file.         ---*/
+/*---                                                   mh_query.c ---*/
+/*--------------------------------------------------------------------*/
+
+/*
+   This file is part of Memhist, a Valgrind tool for tracking memory
+   access history.
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+   02111-1307, USA.
+
+   The GNU General Public License is contained in the file COPYING.
+*/
+
+/*
+ * Reads files written by memhist --trace-file, --dump-file or
+ * VALGRIND_MEMHIST_DUMP_FILE, see mh_trace_format.h.
+ *
+ * The file is mmap'ed and all blocks are decoded once, in parallel,
+ * to build an index of which blocks contain writes to which pages,
+ * sorted by page. Queries then decode only the blocks that may hold
+ * matching writes.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "mh_trace_format.h"
+#include "coregrind/m_debuginfo/minilzo.h"
+
+typedef unsigned int UInt;
+typedef unsigned long long ULong;
+
+#define PAGE_BITS 12
+
+static void die(const char* fmt, const char* arg)
+{
+    fprintf(stderr, "mh_query: ");
+    fprintf(stderr, fmt, arg);
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+static void* xmalloc(size_t sz)
+{
+    void* p = malloc(sz ? sz : 1);
+    if (!p) die("%s", "out of memory");
+    return p;
+}
+
+static void* xrealloc(void* p, size_t sz)
+{
+    p = realloc(p, sz ? sz : 1);
+    if (!p) die("%s", "out of memory");
+    return p;
+}
+
+/* Growable array of fixed size elements */
+struct vec {
+    char* data;
+    size_t n;
+    size_t cap;
+    size_t elt_sz;
+};
+
+static void vec_init(struct vec* v, size_t elt_sz)
+{
+    v->data = NULL;
+    v->n = v->cap = 0;
+    v->elt_sz = elt_sz;
+}
+
+static void* vec_push(struct vec* v)
+{
+    if (v->n == v->cap) {
+	v->cap = v->cap ? 2 * v->cap : 64;
+	v->data = xrealloc(v->data, v->cap * v->elt_sz);
+    }
+    return v->data + v->n++ * v->elt_sz;
+}
+
+static void vec_append(struct vec* v, struct vec* w)
+{
+    size_t i;
+    for (i = 0; i < w->n; i++)
+	memcpy(vec_push(v), w->data + i * w->elt_sz, w->elt_sz);
+}
+
+/*
+ * File and blocks
+ */
+
+struct block {
+    const unsigned char* data;
+    UInt raw_len;
+    UInt comp_len;
+};
+
+static const unsigned char* file_data;
+static size_t file_size;
+static struct mh_trace_file_header file_hdr;
+static struct block* blocks;
+static size_t nblocks;
+static int nthreads = 1;
+
+static void open_file(const char* fname)
+{
+    struct stat st;
+    struct vec bv;
+    size_t pos;
+    int fd = open(fname, O_RDONLY);
+
+    if (fd < 0 || fstat(fd, &st) != 0)
+	die("can not open '%s'", fname);
+    file_size = st.st_size;
+    if (file_size < sizeof(file_hdr))
+	die("'%s' is not a memhist file", fname);
+    file_data = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (file_data == MAP_FAILED)
+	die("can not mmap '%s'", fname);
+    close(fd);
+
+    memcpy(&file_hdr, file_data, sizeof(file_hdr));
+    if (memcmp(file_hdr.magic, MH_TRACE_MAGIC, sizeof(MH_TRACE_MAGIC))
+	|| file_hdr.version != MH_TRACE_VERSION)
+	die("'%s' is not a memhist file of known version", fname);
+
+    /* Only block headers are read here */
+    vec_init(&bv, sizeof(struct block));
+    for (pos = sizeof(file_hdr); pos < file_size; ) {
+	struct mh_trace_block_header bh;
+	struct block* b;
+
+	if (pos + sizeof(bh) > file_size)
+	    die("truncated block header in '%s'", fname);
+	memcpy(&bh, file_data + pos, sizeof(bh));
+	pos += sizeof(bh);
+	if (bh.magic != MH_TRACE_BLOCK_MAGIC
+	    || bh.raw_len > file_hdr.block_size
+	    || bh.comp_len > file_size - pos)
+	    die("corrupt block in '%s'", fname);
+	b = vec_push(&bv);
+	b->data = file_data + pos;
+	b->raw_len = bh.raw_len;
+	b->comp_len = bh.comp_len;
+	pos += bh.comp_len;
+    }
+    blocks = (struct block*)bv.data;
+    nblocks = bv.n;
+}
+
+/* Decode block 'bix' into 'buf' of file_hdr.block_size bytes */
+static const unsigned char* decode_block(size_t bix, unsigned char* buf)
+{
+    struct block* b = &blocks[bix];
+    lzo_uint len = b->raw_len;
+
+    if (b->comp_len >= b->raw_len)
+	return b->data;
+    if (lzo1x_decompress_safe(b->data, b->comp_len, buf, &len, NULL) != LZO_E_OK
+	|| len != b->raw_len)
+	die("%s", "corrupt compressed block");
+    return buf;
+}
+
+/*
+ * Run 'fn' for each of the blocks in 'bixv' in 'nthreads' threads.
+ * Each worker gets its own result vectors.
+ */
+
+struct worker {
+    pthread_t thread;
+    int ix;
+    const size_t* bixv;
+    size_t nbix;
+    void (*fn)(struct worker*, size_t bix, const unsigned char* p, UInt len);
+    const void* arg;
+    struct vec out[3];
+};
+
+static void* worker_main(void* arg)
+{
+    struct worker* w = arg;
+    unsigned char* buf = xmalloc(file_hdr.block_size);
+    size_t i;
+
+    for (i = w->ix; i < w->nbix; i += nthreads) {
+	size_t bix = w->bixv[i];
+	w->fn(w, bix, decode_block(bix, buf), blocks[bix].raw_len);
+    }
+    free(buf);
+    return NULL;
+}
+
+static struct worker* run_workers(const size_t* bixv, size_t nbix,
+				  void (*fn)(struct worker*, size_t,
+					     const unsigned char*, UInt),
+				  const void* arg, size_t elt_sz[3])
+{
+    struct worker* ws = xmalloc(nthreads * sizeof(*ws));
+    int t, k;
+
+    for (t = 0; t < nthreads; t++) {
+	ws[t].ix = t;
+	ws[t].bixv = bixv;
+	ws[t].nbix = nbix;
+	ws[t].fn = fn;
+	ws[t].arg = arg;
+	for (k = 0; k < 3; k++)
+	    vec_init(&ws[t].out[k], elt_sz[k]);
+	if (nthreads > 1
+	    && pthread_create(&ws[t].thread, NULL, worker_main, &ws[t]))
+	    die("%s", "can not create thread");
+    }
+    if (nthreads == 1)
+	worker_main(&ws[0]);
+    else {
+	for (t = 0; t < nthreads; t++)
+	    pthread_join(ws[t].thread, NULL);
+    }
+    return ws;
+}
+
+/* Merge output 'k' of all workers into 'v' */
+static void merge_workers(struct worker* ws, int k, struct vec* v)
+{
+    int t;
+    for (t = 0; t < nthreads; t++) {
+	vec_append(v, &ws[t].out[k]);
+	free(ws[t].out[k].data);
+    }
+}
+
+/*
+ * Index: (page, block) pairs sorted by page, all stacks and regions
+ */
+
+struct page_ref {
+    ULong page;
+    size_t bix;
+};
+
+struct stack_ref {
+    UInt stack;
+    const struct mh_trace_stack* rec;   /* points into decoded copy */
+};
+
+struct region_ref {
+    struct mh_trace_region rec;
+    char name[256];
+    size_t bix;
+    size_t offs;
+};
+
+/* Lifetime of a region, it covers writes with born < time < died */
+struct region_span {
+    ULong start, end;
+    ULong born, died;
+    const char* name;
+};
+
+static struct vec index_pages;   /* struct page_ref */
+static struct vec index_stacks;  /* struct stack_ref */
+static struct vec index_regions; /* struct region_ref */
+static struct vec index_spans;   /* struct region_span, sorted by start */
+static ULong* span_max_end;      /* max end of index_spans[0..i] */
+
+static int cmp_page_ref(const void* a, const void* b)
+{
+    const struct page_ref* x = a;
+    const struct page_ref* y = b;
+    if (x->page != y->page) return x->page < y->page ? -1 : 1;
+    return x->bix < y->bix ? -1 : (x->bix > y->bix);
+}
+
+static int cmp_stack_ref(const void* a, const void* b)
+{
+    const struct stack_ref* x = a;
+    const struct stack_ref* y = b;
+    return x->stack < y->stack ? -1 : (x->stack > y->stack);
+}
+
+static int cmp_region_ref(const void* a, const void* b)
+{
+    const struct region_ref* x = a;
+    const struct region_ref* y = b;
+    if (x->bix != y->bix) return x->bix < y->bix ? -1 : 1;
+    return x->offs < y->offs ? -1 : (x->offs > y->offs);
+}
+
+static int cmp_region_span(const void* a, const void* b)
+{
+    const struct region_span* x = a;
+    const struct region_span* y = b;
+    if (x->start != y->start) return x->start < y->start ? -1 : 1;
+    return x->born < y->born ? -1 : (x->born > y->born);
+}
+
+static void index_block(struct worker* w, size_t bix,
+			const unsigned char* p, UInt len)
+{
+    ULong last_page = ~0ULL;
+    UInt offs;
+
+    for (offs = 0; offs < len; ) {
+	const struct mh_trace_rec* rec = (const void*)(p + offs);
+
+	if (rec->len < sizeof(*rec) || rec->len > len - offs)
+	    die("%s", "corrupt record");
+
+	switch (rec->kind) {
+	case MH_TRACE_REC_WRITE: {
+	    const struct mh_trace_write* wr = (const void*)rec;
+	    ULong page, end_page;
+	    if (rec->len < sizeof(*wr))
+		die("%s", "corrupt record");
+	    page = wr->addr >> PAGE_BITS;
+	    end_page = (wr->addr + wr->size - 1) >> PAGE_BITS;
+	    for ( ; page <= end_page; page++) {
+		if (page != last_page) {
+		    struct page_ref* pr = vec_push(&w->out[0]);
+		    pr->page = page;
+		    pr->bix = bix;
+		    last_page = page;
+		}
+	    }
+	    break;
+	}
+	case MH_TRACE_REC_STACK: {
+	    const struct mh_trace_stack* st = (const void*)rec;
+	    struct stack_ref* sr;
+	    void* copy;
+	    if (rec->len < sizeof(*st)
+		|| (rec->len - sizeof(*st)) / sizeof(st->ips[0]) < st->n_ips)
+		die("%s", "corrupt record");
+	    sr = vec_push(&w->out[1]);
+	    copy = xmalloc(rec->len);
+	    memcpy(copy, rec, rec->len);
+	    sr->rec = copy;
+	    sr->stack = sr->rec->stack;
+	    break;
+	}
+	case MH_TRACE_REC_REGION:
+	case MH_TRACE_REC_UNTRACK: {
+	    struct region_ref* rr;
+	    if (rec->len < sizeof(rr->rec))
+		die("%s", "corrupt record");
+	    rr = vec_push(&w->out[2]);
+	    memcpy(&rr->rec, rec, sizeof(rr->rec));
+	    rr->name[0] = '\0';
+	    if (rec->kind == MH_TRACE_REC_REGION) {
+		size_t n = rec->len - sizeof(rr->rec);
+		if (n > sizeof(rr->name) - 1) n = sizeof(rr->name) - 1;
+		memcpy(rr->name, (const char*)rec + sizeof(rr->rec), n);
+		rr->name[n] = '\0';
+	    }
+	    rr->bix = bix;
+	    rr->offs = offs;
+	    break;
+	}
+	default:
+	    break;   /* unknown record kinds are skipped */
+	}
+	offs += rec->len;
+    }
+}
+
+/* Pair each created region with its untrack record. Regions never
+   overlap while tracked, so the one untracked is the last one created
+   before at the same start. */
+static void build_spans(void)
+{
+    const struct region_ref* rv = (const struct region_ref*)index_regions.data;
+    struct region_span* sv;
+    size_t i, n;
+
+    vec_init(&index_spans, sizeof(struct region_span));
+    for (i = 0; i < index_regions.n; i++) {
+	struct region_span* sp;
+	if (rv[i].rec.rec.kind != MH_TRACE_REC_REGION)
+	    continue;
+	sp = vec_push(&index_spans);
+	sp->start = rv[i].rec.start;
+	sp->end = rv[i].rec.end;
+	sp->born = rv[i].rec.time;
+	sp->died = ~0ULL;
+	sp->name = rv[i].name;
+    }
+    sv = (struct region_span*)index_spans.data;
+    n = index_spans.n;
+    qsort(sv, n, sizeof(*sv), cmp_region_span);
+
+    for (i = 0; i < index_regions.n; i++) {
+	const struct mh_trace_region* u = &rv[i].rec;
+	size_t lo = 0, hi = n;
+	if (u->rec.kind != MH_TRACE_REC_UNTRACK)
+	    continue;
+	/* First span after (u->start, u->time) */
+	while (lo < hi) {
+	    size_t mid = (lo + hi) / 2;
+	    if (sv[mid].start < u->start
+		|| (sv[mid].start == u->start && sv[mid].born < u->time))
+		lo = mid + 1;
+	    else
+		hi = mid;
+	}
+	if (lo > 0 && sv[lo-1].start == u->start && sv[lo-1].end == u->end
+	    && sv[lo-1].died == ~0ULL)
+	    sv[lo-1].died = u->time;
+    }
+
+    span_max_end = xmalloc(n * sizeof(ULong));
+    for (i = 0; i < n; i++)
+	span_max_end[i] = (i && span_max_end[i-1] > sv[i].end)
+			  ? span_max_end[i-1] : sv[i].end;
+}
+
+static void build_index(void)
+{
+    size_t* all = xmalloc(nblocks * sizeof(size_t));
+    size_t elt_sz[3] = { sizeof(struct page_ref), sizeof(struct stack_ref),
+			 sizeof(struct region_ref) };
+    struct worker* ws;
+    size_t i, n;
+
+    for (i = 0; i < nblocks; i++)
+	all[i] = i;
+    ws = run_workers(all, nblocks, index_block, NULL, elt_sz);
+
+    vec_init(&index_pages, elt_sz[0]);
+    vec_init(&index_stacks, elt_sz[1]);
+    vec_init(&index_regions, elt_sz[2]);
+    merge_workers(ws, 0, &index_pages);
+    merge_workers(ws, 1, &index_stacks);
+    merge_workers(ws, 2, &index_regions);
+    free(ws);
+    free(all);
+
+    qsort(index_pages.data, index_pages.n, sizeof(struct page_ref), cmp_page_ref);
+    for (i = n = 0; i < index_pages.n; i++) {
+	struct page_ref* pr = (struct page_ref*)index_pages.data;
+	if (!n || cmp_page_ref(&pr[n-1], &pr[i]))
+	    pr[n++] = pr[i];
+    }
+    index_pages.n = n;
+    qsort(index_stacks.data, index_stacks.n, sizeof(struct stack_ref), cmp_stack_ref);
+    qsort(index_regions.data, index_regions.n, sizeof(struct region_ref),
+	  cmp_region_ref);
+    build_spans();
+}
+
+static const struct mh_trace_stack* find_stack(UInt stack)
+{
+    const struct stack_ref* v = (const struct stack_ref*)index_stacks.data;
+    size_t lo = 0, hi = index_stacks.n;
+
+    while (lo < hi) {
+	size_t mid = (lo + hi) / 2;
+	if (v[mid].stack < stack) lo = mid + 1;
+	else hi = mid;
+    }
+    return (lo < index_stacks.n && v[lo].stack == stack) ? v[lo].rec : NULL;
+}
+
+/* Name of the region containing 'addr' at 'time' */
+static const char* find_region_name(ULong addr, ULong time)
+{
+    const struct region_span* v = (const struct region_span*)index_spans.data;
+    size_t lo = 0, hi = index_spans.n;
+
+    /* First span starting above 'addr' */
+    while (lo < hi) {
+	size_t mid = (lo + hi) / 2;
+	if (v[mid].start <= addr) lo = mid + 1;
+	else hi = mid;
+    }
+    for ( ; lo > 0 && span_max_end[lo-1] > addr; lo--) {
+	const struct region_span* sp = &v[lo-1];
+	if (addr < sp->end && sp->born < time && time < sp->died)
+	    return sp->name;
+    }
+    return NULL;
+}
+
+/*
+ * Queries
+ */
+
+struct query {
+    ULong start, end;   /* address range */
+    ULong t1, t2;       /* time range, inclusive */
+};
+
+static int cmp_size(const void* a, const void* b)
+{
+    size_t x = *(const size_t*)a;
+    size_t y = *(const size_t*)b;
+    return x < y ? -1 : (x > y);
+}
+
+static void query_block(struct worker* w, size_t bix,
+			const unsigned char* p, UInt len)
+{
+    const struct query* q = w->arg;
+    UInt offs;
+
+    for (offs = 0; offs < len; ) {
+	const struct mh_trace_rec* rec = (const void*)(p + offs);
+
+	if (rec->len < sizeof(*rec) || rec->len > len - offs)
+	    die("%s", "corrupt record");
+	if (rec->kind == MH_TRACE_REC_WRITE) {
+	    const struct mh_trace_write* wr = (const void*)rec;
+	    if (wr->addr < q->end && wr->addr + wr->size > q->start
+		&& wr->time >= q->t1 && wr->time <= q->t2)
+		memcpy(vec_push(&w->out[0]), wr, sizeof(*wr));
+	}
+	offs += rec->len;
+    }
+}
+
+static int cmp_write(const void* a, const void* b)
+{
+    const struct mh_trace_write* x = a;
+    const struct mh_trace_write* y = b;
+    if (x->time != y->time) return x->time < y->time ? -1 : 1;
+    return x->addr < y->addr ? -1 : (x->addr > y->addr);
+}
+
+static void print_write(const struct mh_trace_write* wr)
+{
+    const struct mh_trace_stack* sr = find_stack(wr->stack);
+    const char* name = find_region_name(wr->addr, wr->time);
+    UInt i;
+
+    printf("%u-bytes ", wr->size);
+    if (wr->size <= 8)
+	printf("%#llx ", wr->data);
+    printf("written to address %#llx", wr->addr);
+    if (name)
+	printf(" in '%s'", name);
+    printf(" by thread %u at time %llu", wr->tid, wr->time);
+    if (wr->icount)
+	printf(" after %llu instructions", wr->icount);
+    printf(":\n");
+    if (!sr) {
+	printf("   (unknown stack %u)\n", wr->stack);
+	return;
+    }
+    for (i = 0; i < sr->n_ips; i++)
+	printf("   %s %#llx\n", i ? "by" : "at", sr->ips[i]);
+}
+
+static void run_query(const struct query* q)
+{
+    const struct page_ref* v = (const struct page_ref*)index_pages.data;
+    ULong p0 = q->start >> PAGE_BITS;
+    ULong p1 = (q->end - 1) >> PAGE_BITS;
+    size_t lo = 0, hi = index_pages.n, i, n;
+    struct vec bixv, writes;
+    size_t elt_sz[3] = { sizeof(struct mh_trace_write), 1, 1 };
+    struct worker* ws;
+
+    /* Find blocks with writes to any page of the range */
+    while (lo < hi) {
+	size_t mid = (lo + hi) / 2;
+	if (v[mid].page < p0) lo = mid + 1;
+	else hi = mid;
+    }
+    vec_init(&bixv, sizeof(size_t));
+    for (i = lo; i < index_pages.n && v[i].page <= p1; i++)
+	*(size_t*)vec_push(&bixv) = v[i].bix;
+
+    /* Blocks may be listed once per page, so sort and unique */
+    qsort(bixv.data, bixv.n, sizeof(size_t), cmp_size);
+    for (i = n = 0; i < bixv.n; i++) {
+	size_t* b = (size_t*)bixv.data;
+	if (!n || b[n-1] != b[i])
+	    b[n++] = b[i];
+    }
+    bixv.n = n;
+
+    ws = run_workers((size_t*)bixv.data, bixv.n, query_block, q, elt_sz);
+    vec_init(&writes, elt_sz[0]);
+    merge_workers(ws, 0, &writes);
+    free(ws);
+    free(bixv.data);
+
+    qsort(writes.data, writes.n, sizeof(struct mh_trace_write), cmp_write);
+    for (i = 0; i < writes.n; i++)
+	print_write((struct mh_trace_write*)writes.data + i);
+    if (!writes.n)
+	printf("No writes found.\n");
+    free(writes.data);
+}
+
+static void print_regions(void)
+{
+    const struct region_ref* v = (const struct region_ref*)index_regions.data;
+    size_t i;
+
+    for (i = 0; i < index_regions.n; i++) {
+	const struct mh_trace_region* rr = &v[i].rec;
+	if (rr->rec.kind == MH_TRACE_REC_REGION && !rr->history)
+	    printf("Region '%s' from %#llx to %#llx with word size %u in "
+		   "heatmap mode created at time %llu.\n", v[i].name,
+		   rr->start, rr->end, rr->word_sz, rr->time);
+	else if (rr->rec.kind == MH_TRACE_REC_REGION)
+	    printf("Region '%s' from %#llx to %#llx with word size %u and "
+		   "history %u created at time %llu.\n", v[i].name,
+		   rr->start, rr->end, rr->word_sz, rr->history, rr->time);
+	else
+	    printf("Region from %#llx to %#llx untracked at time %llu.\n",
+		   rr->start, rr->end, rr->time);
+    }
+}
+
+static ULong parse_num(const char* s)
+{
+    char* end;
+    ULong v;
+
+    errno = 0;
+    v = strtoull(s, &end, 0);
+    if (errno || *end || end == s)
+	die("bad number '%s'", s);
+    return v;
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+	    "usage: mh_query [-j <threads>] <file> <command>\n"
+	    "commands:\n"
+	    "  regions                        list tracked regions\n"
+	    "  stats                          print file statistics\n"
+	    "  who_wrote <addr> [<t1> [<t2>]] writes to <addr> between times\n"
+	    "  writers <addr> <len> [<t1> [<t2>]]\n"
+	    "                                 writes to [<addr>,<addr>+<len>)\n");
+    exit(1);
+}
+
+int main(int argc, char** argv)
+{
+    int a = 1;
+    const char* cmd;
+    struct query q;
+
+    if (a + 1 < argc && !strcmp(argv[a], "-j")) {
+	nthreads = (int)parse_num(argv[a+1]);
+	if (nthreads < 1) nthreads = 1;
+	a += 2;
+    }
+    if (argc - a < 2)
+	usage();
+
+    open_file(argv[a++]);
+    build_index();
+    cmd = argv[a++];
+
+    if (!strcmp(cmd, "regions")) {
+	print_regions();
+    }
+    else if (!strcmp(cmd, "stats")) {
+	printf("blocks: %zu, pages indexed: %zu, stacks: %zu, regions: %zu\n",
+	       nblocks, index_pages.n, index_stacks.n, index_regions.n);
+    }
+    else if (!strcmp(cmd, "who_wrote") || !strcmp(cmd, "writers")) {
+	ULong len = 1;
+
+	if (a >= argc) usage();
+	q.start = parse_num(argv[a++]);
+	if (!strcmp(cmd, "writers")) {
+	    if (a >= argc) usage();
+	    len = parse_num(argv[a++]);
+	    if (!len) usage();
+	}
+	q.end = q.start + len;
+	q.t1 = a < argc ? parse_num(argv[a++]) : 0;
+	q.t2 = a < argc ? parse_num(argv[a++]) : ~0ULL;
+	if (a < argc) usage();
+	run_query(&q);
+    }
+    else
+	usage();
+
+    return 0;
+}
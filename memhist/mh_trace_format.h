@@ -0,0 +1,86 @@
+/*
+ * Binary write trace produced by memhist --trace-file=<file>
+ *
+ * Shared between the tool and stand-alone readers, so only plain C types
+ * are used. 'unsigned int' is 32 bits and 'unsigned long long' 64 bits
+ * on all supported platforms. All values are in host byte order.
+ *
+ * The file starts with a struct mh_trace_file_header followed by a
+ * sequence of blocks. Each block is a struct mh_trace_block_header
+ * followed by 'comp_len' bytes of data. If comp_len < raw_len the data
+ * is compressed with LZO1X-1, otherwise it is stored as is.
+ *
+ * An uncompressed block is a sequence of records, each starting with
+ * a struct mh_trace_rec. Records never span blocks, so blocks can be
+ * decoded independently of each other. All records are 8 byte aligned.
+ *
+ * Stack ids are ExeContext unique ids. A stack record for an id is
+ * written before the first record that refers to it.
+ */
+
+#ifndef __MH_TRACE_FORMAT_H
+#define __MH_TRACE_FORMAT_H
+
+#define MH_TRACE_MAGIC        "MHTRACE"   /* 7 chars + NUL */
+#define MH_TRACE_VERSION      3
+#define MH_TRACE_BLOCK_MAGIC  0x4b42484d  /* "MHBK" */
+#define MH_TRACE_BLOCK_SIZE   (1024 * 1024)  /* max raw_len */
+
+struct mh_trace_file_header {
+    char magic[8];
+    unsigned int version;
+    unsigned int block_size;   /* max raw_len of any block */
+    unsigned int addr_size;    /* sizeof(Addr) in the traced process */
+    unsigned int pad;
+};
+
+struct mh_trace_block_header {
+    unsigned int magic;
+    unsigned int raw_len;
+    unsigned int comp_len;
+    unsigned int pad;
+};
+
+enum mh_trace_rec_kind {
+    MH_TRACE_REC_WRITE   = 1,
+    MH_TRACE_REC_STACK   = 2,
+    MH_TRACE_REC_REGION  = 3,  /* tracked region created */
+    MH_TRACE_REC_UNTRACK = 4   /* tracked region removed */
+};
+
+struct mh_trace_rec {
+    unsigned int kind;
+    unsigned int len;          /* of whole record, multiple of 8 */
+};
+
+struct mh_trace_write {
+    struct mh_trace_rec rec;
+    unsigned long long addr;
+    unsigned long long data;   /* stored value if size <= 8, else 0 */
+    unsigned long long time;
+    unsigned long long icount; /* instructions executed by writing thread,
+				  0 unless --count-instrs=yes */
+    unsigned int stack;
+    unsigned int size;
+    unsigned int tid;          /* writing thread */
+    unsigned int pad;
+};
+
+struct mh_trace_stack {
+    struct mh_trace_rec rec;
+    unsigned int stack;
+    unsigned int n_ips;
+    unsigned long long ips[0];
+};
+
+struct mh_trace_region {
+    struct mh_trace_rec rec;
+    unsigned long long start;
+    unsigned long long end;
+    unsigned long long time;
+    unsigned int word_sz;      /* 0 for MH_TRACE_REC_UNTRACK */
+    unsigned int history;      /* 0 in a dump for heatmap mode */
+    char name[0];              /* NUL terminated, only for REGION */
+};
+
+#endif /* __MH_TRACE_FORMAT_H */
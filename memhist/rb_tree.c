@@ -40,20 +40,34 @@ void rb_tree_init(rb_tree *newTree,
 
     /*  see the comment in the rb_tree structure in red_black_tree.h */
     /*  for information on nil and root */
-    temp = &newTree->nil;
+    temp = newTree->nil = &newTree->nil_node;
     temp->parent = temp->left = temp->right = temp;
     temp->red = 0;
     temp = &newTree->root;
-    temp->parent = temp->left = temp->right = &newTree->nil;
+    temp->parent = temp->left = temp->right = newTree->nil;
     temp->red = 0;
     CHECK_TREE(newTree, NULL);
 }
 
 
+/*
+ * Initialize a new empty tree with the same callbacks and nil as 'tree'.
+ * Nodes can then be moved between the two with split and join.
+ * 'newTree' must not be used after 'tree' is gone.
+ */
+void rb_tree_init_from(rb_tree *newTree, rb_tree *tree)
+{
+    rb_tree_init(newTree, tree->cmp, tree->cmp_key, tree->update_subtree,
+		 tree->print_node);
+    newTree->nil = tree->nil;
+    newTree->root.parent = newTree->root.left = newTree->root.right = tree->nil;
+}
+
+
 static void left_rotate(rb_tree *tree, rb_tree_node *x)
 {
     rb_tree_node *y;
-    rb_tree_node *nil = &tree->nil;
+    rb_tree_node *nil = tree->nil;
 
     y = x->right;
     x->right = y->left;
@@ -75,14 +89,14 @@ static void left_rotate(rb_tree *tree, rb_tree_node *x)
     ASSERT(!(y->parent != &tree->root
 	     && tree->update_subtree(tree, y->parent, 0)));
 
-    ASSERT(!tree->nil.red);
+    ASSERT(!tree->nil->red);
 }
 
 
 static void right_rotate(rb_tree *tree, rb_tree_node *y)
 {
     rb_tree_node *x;
-    rb_tree_node *nil = &tree->nil;
+    rb_tree_node *nil = tree->nil;
 
     x = y->left;
     y->left = x->right;
@@ -104,7 +118,7 @@ static void right_rotate(rb_tree *tree, rb_tree_node *y)
     ASSERT(!(x->parent != &tree->root
 	     && tree->update_subtree(tree, x->parent, 0)));
 
-    ASSERT(!tree->nil.red);
+    ASSERT(!tree->nil->red);
 }
 
 
@@ -117,7 +131,7 @@ static rb_tree_node* insert_helper(rb_tree *tree, rb_tree_node *z)
 {
     rb_tree_node *x;
     rb_tree_node *y;
-    rb_tree_node *nil = &tree->nil;
+    rb_tree_node *nil = tree->nil;
     int cmp = 1; /* to insert first node as root->left */
 
     z->left = z->right = nil;
@@ -140,31 +154,19 @@ static rb_tree_node* insert_helper(rb_tree *tree, rb_tree_node *z)
 	y->right = z;
     }
 
-    ASSERT(!tree->nil.red);
+    ASSERT(!tree->nil->red);
     return NULL;
 }
 
 
-/* Try insert new node with unique key.
- *
- * RETURN:  NULL if inserted otherwise clashing node
+/* Perform rotations and change colors to restore red-black
+ * properties after red node 'x' is linked in.
+ * The root is left to be colored black by the caller.
  */
-rb_tree_node* rb_tree_insert(rb_tree *tree, rb_tree_node *x)
+static void insert_fixup(rb_tree *tree, rb_tree_node *x)
 {
     rb_tree_node *y;
-    rb_tree_node *clash;
-
-    CHECK_TREE(tree, NULL);
 
-    clash = insert_helper(tree, x);
-    if (clash) return clash;
-    x->red = 1;
-
-    ASSERT(x->left == &tree->nil && x->right == &tree->nil);
-    for (y = x->parent; y != &tree->root; y = y->parent) {
-	if (!tree->update_subtree(tree, y, 1))
-	    break;
-    }
     while (x->parent->red) { /* use sentinel instead of checking for root */
 	if (x->parent == x->parent->parent->left) {
 	    y = x->parent->parent->right;
@@ -200,6 +202,30 @@ rb_tree_node* rb_tree_insert(rb_tree *tree, rb_tree_node *x)
 	    }
 	}
     }
+}
+
+
+/* Try insert new node with unique key.
+ *
+ * RETURN:  NULL if inserted otherwise clashing node
+ */
+rb_tree_node* rb_tree_insert(rb_tree *tree, rb_tree_node *x)
+{
+    rb_tree_node *y;
+    rb_tree_node *clash;
+
+    CHECK_TREE(tree, NULL);
+
+    clash = insert_helper(tree, x);
+    if (clash) return clash;
+    x->red = 1;
+
+    ASSERT(x->left == tree->nil && x->right == tree->nil);
+    for (y = x->parent; y != &tree->root; y = y->parent) {
+	if (!tree->update_subtree(tree, y, 1))
+	    break;
+    }
+    insert_fixup(tree, x);
     tree->root.left->red = 0;
 
     CHECK_TREE(tree, x);
@@ -213,7 +239,7 @@ rb_tree_node* rb_tree_min(rb_tree *tree)
 {
     rb_tree_node *x;
     rb_tree_node *min = NULL;
-    rb_tree_node *nil = &tree->nil;
+    rb_tree_node *nil = tree->nil;
 
     x = tree->root.left;
     while (x != nil) {
@@ -230,7 +256,7 @@ rb_tree_node* rb_tree_min(rb_tree *tree)
 rb_tree_node* rb_tree_succ(rb_tree *tree, rb_tree_node *x)
 {
     rb_tree_node *y;
-    rb_tree_node *nil  = &tree->nil;
+    rb_tree_node *nil  = tree->nil;
     rb_tree_node *root = &tree->root;
 
     y = x->right;
@@ -254,7 +280,7 @@ rb_tree_node* rb_tree_succ(rb_tree *tree, rb_tree_node *x)
 rb_tree_node* rb_tree_pred(rb_tree *tree, rb_tree_node *x)
 {
     rb_tree_node *y;
-    rb_tree_node *nil  = &tree->nil;
+    rb_tree_node *nil  = tree->nil;
     rb_tree_node *root = &tree->root;
 
     y = x->left;
@@ -276,7 +302,7 @@ rb_tree_node* rb_tree_pred(rb_tree *tree, rb_tree_node *x)
 
 static void inorder_print(rb_tree *tree, rb_tree_node *x, int depth)
 {
-    if (x != &tree->nil) {
+    if (x != tree->nil) {
 	inorder_print(tree, x->left, depth + 1);
 	tree->print_node(x, depth);
 	inorder_print(tree, x->right, depth + 1);
@@ -296,7 +322,7 @@ void rb_tree_print(rb_tree *tree) {
 rb_tree_node* rb_tree_lookup_exact(rb_tree *tree, void *key)
 {
     rb_tree_node *x = tree->root.left;
-    rb_tree_node *nil = &tree->nil;
+    rb_tree_node *nil = tree->nil;
     int cmp;
 
     for (;;) {
@@ -319,7 +345,7 @@ rb_tree_node* rb_tree_lookup_exact(rb_tree *tree, void *key)
 rb_tree_node* rb_tree_lookup_maxle(rb_tree *tree, void *key)
 {
     rb_tree_node *x = tree->root.left;
-    rb_tree_node *nil = &tree->nil;
+    rb_tree_node *nil = tree->nil;
     rb_tree_node *maxless = NULL;
     int cmp;
 
@@ -342,7 +368,7 @@ rb_tree_node* rb_tree_lookup_maxle(rb_tree *tree, void *key)
 rb_tree_node* rb_tree_lookup_ming(rb_tree *tree, void *key)
 {
     rb_tree_node *x = tree->root.left;
-    rb_tree_node *nil = &tree->nil;
+    rb_tree_node *nil = tree->nil;
     rb_tree_node *ming = NULL;
     int cmp;
 
@@ -421,7 +447,7 @@ static void remove_fixup(rb_tree *tree, rb_tree_node *x)
     }
     x->red = 0;
 
-    ASSERT(!tree->nil.red);
+    ASSERT(!tree->nil->red);
 }
 
 
@@ -432,7 +458,7 @@ void rb_tree_remove(rb_tree *tree, rb_tree_node *z)
 {
     rb_tree_node *y;
     rb_tree_node *x;
-    rb_tree_node *nil =  &tree->nil;
+    rb_tree_node *nil =  tree->nil;
     rb_tree_node *root = &tree->root;
     rb_tree_node *p;
 
@@ -460,7 +486,7 @@ void rb_tree_remove(rb_tree *tree, rb_tree_node *z)
 
     if (y != z) { /* y should not be nil in this case */
 
-	ASSERT(y != &tree->nil);
+	ASSERT(y != tree->nil);
 
 	/* y is the node to splice out and x is its child */
 
@@ -492,6 +518,245 @@ void rb_tree_remove(rb_tree *tree, rb_tree_node *z)
 }
 
 
+/* Return black height of 'x', not counting nil.
+ */
+static int black_height(rb_tree *tree, rb_tree_node *x)
+{
+    int bh = 0;
+
+    for ( ; x != tree->nil; x = x->left)
+	bh += !x->red;
+    return bh;
+}
+
+
+/* Join detached sub-trees 'l' and 'r', with black heights 'lbh' and 'rbh',
+ * using 'k' as pivot. All keys in 'l' must be less than k and all keys
+ * in 'r' greater. Only the spine of the higher sub-tree down to the
+ * black height of the lower one is visited. tree->root must be empty
+ * as it is used as parent while rebalancing.
+ *
+ * RETURN: Root of the joined sub-tree and its black height in 'bh'
+ */
+static rb_tree_node* join_nodes(rb_tree *tree,
+				rb_tree_node *l, int lbh,
+				rb_tree_node *k,
+				rb_tree_node *r, int rbh,
+				int *bh)
+{
+    rb_tree_node *nil = tree->nil;
+    rb_tree_node *root = &tree->root;
+    rb_tree_node *c;
+    rb_tree_node *p;
+    int h;
+
+    ASSERT(root->left == nil);
+
+    /* a red root may only be linked in below a red k if it is made black */
+    if (l->red) { l->red = 0; lbh++; }
+    if (r->red) { r->red = 0; rbh++; }
+
+    if (lbh == rbh) {
+	k->left = l;
+	k->right = r;
+	k->red = 0;
+	if (l != nil) l->parent = k;
+	if (r != nil) r->parent = k;
+	tree->update_subtree(tree, k, 1);
+	*bh = lbh + 1;
+	return k;
+    }
+
+    if (lbh > rbh) {
+	/* replace black node on right spine of l that is as high as r */
+	root->left = l;
+	l->parent = root;
+	for (p = root, c = l, h = lbh; c->red || h > rbh; c = c->right) {
+	    h -= !c->red;
+	    p = c;
+	}
+	k->left = c;
+	k->right = r;
+	p->right = k;
+	if (r != nil) r->parent = k;
+    }
+    else {
+	root->left = r;
+	r->parent = root;
+	for (p = root, c = r, h = rbh; c->red || h > lbh; c = c->left) {
+	    h -= !c->red;
+	    p = c;
+	}
+	k->left = l;
+	k->right = c;
+	p->left = k;
+	if (l != nil) l->parent = k;
+    }
+    ASSERT(p != root);
+    k->parent = p;
+    k->red = 1;
+    if (c != nil) c->parent = k;
+
+    tree->update_subtree(tree, k, 1); /* k may hold any stale state */
+    for (p = k->parent; p != root; p = p->parent) {
+	if (!tree->update_subtree(tree, p, 1))
+	    break;
+    }
+    insert_fixup(tree, k);
+
+    c = root->left;
+    *bh = (lbh > rbh ? lbh : rbh) + c->red;
+    c->red = 0;
+    root->left = nil;
+    return c;
+}
+
+
+/* Split detached sub-tree 'x' with black height 'bh' into 'l' with keys
+ * less than 'key' and 'r' with the rest.
+ */
+static void split_nodes(rb_tree *tree, rb_tree_node *x, int bh, void *key,
+			rb_tree_node **l, int *lbh,
+			rb_tree_node **r, int *rbh)
+{
+    rb_tree_node *y;
+    int ybh;
+
+    if (x == tree->nil) {
+	*l = *r = x;
+	*lbh = *rbh = 0;
+	return;
+    }
+    bh -= !x->red;
+    if (tree->cmp_key(x, key) < 0) { /* x->key < key */
+	split_nodes(tree, x->right, bh, key, &y, &ybh, r, rbh);
+	*l = join_nodes(tree, x->left, bh, x, y, ybh, lbh);
+    }
+    else {
+	split_nodes(tree, x->left, bh, key, l, lbh, &y, &ybh);
+	*r = join_nodes(tree, y, ybh, x, x->right, bh, rbh);
+    }
+}
+
+
+static void set_root(rb_tree *tree, rb_tree_node *x)
+{
+    tree->root.left = x;
+    if (x != tree->nil) {
+	x->parent = &tree->root;
+	x->red = 0;
+    }
+}
+
+
+/* Split tree in O(log n). Nodes with key less than 'key' stay in 'tree'
+ * and the rest are moved to 'right', which is initialized
+ * as by rb_tree_init_from().
+ */
+void rb_tree_split(rb_tree *tree, void *key, rb_tree *right)
+{
+    rb_tree_node *x = tree->root.left;
+    rb_tree_node *l;
+    rb_tree_node *r;
+    int lbh, rbh;
+
+    CHECK_TREE(tree, NULL);
+    rb_tree_init_from(right, tree);
+
+    tree->root.left = tree->nil;
+    split_nodes(tree, x, black_height(tree, x), key, &l, &lbh, &r, &rbh);
+
+    set_root(tree, l);
+    set_root(right, r);
+    CHECK_TREE(tree, NULL);
+    CHECK_TREE(right, NULL);
+}
+
+
+/* Move all nodes of 'right' into 'tree' in O(log n). All keys in 'right'
+ * must be greater than the keys in 'tree' and the trees must share nil,
+ * see rb_tree_init_from(). 'right' is left empty.
+ */
+void rb_tree_join(rb_tree *tree, rb_tree *right)
+{
+    rb_tree_node *nil = tree->nil;
+    rb_tree_node *l = tree->root.left;
+    rb_tree_node *k;
+    rb_tree_node *x;
+    int bh;
+
+    ASSERT(right->nil == nil);
+    CHECK_TREE(tree, NULL);
+    CHECK_TREE(right, NULL);
+
+    if (right->root.left == nil)
+	return;
+    if (l == nil) {
+	set_root(tree, right->root.left);
+	right->root.left = nil;
+	return;
+    }
+
+    k = rb_tree_min(right);
+    for (x = l; x->right != nil; x = x->right)
+	;
+    ASSERT(tree->cmp(x, k) < 0);
+    rb_tree_remove(right, k);
+
+    tree->root.left = nil;
+    x = join_nodes(tree, l, black_height(tree, l), k,
+		   right->root.left, black_height(right, right->root.left),
+		   &bh);
+    set_root(tree, x);
+    right->root.left = nil;
+    CHECK_TREE(tree, NULL);
+}
+
+
+static rb_tree_node* build_nodes(rb_tree *tree, rb_tree_node **nodes,
+				 unsigned long n, int depth, int red_depth)
+{
+    rb_tree_node *x;
+    unsigned long mid = n / 2;
+
+    if (n == 0)
+	return tree->nil;
+
+    x = nodes[mid];
+    x->left = build_nodes(tree, nodes, mid, depth + 1, red_depth);
+    x->right = build_nodes(tree, nodes + mid + 1, n - mid - 1,
+			   depth + 1, red_depth);
+    if (x->left != tree->nil) x->left->parent = x;
+    if (x->right != tree->nil) x->right->parent = x;
+    x->red = (depth == red_depth);
+    tree->update_subtree(tree, x, 1);
+    return x;
+}
+
+
+/* Build balanced tree from 'n' nodes sorted by key in O(n).
+ * The tree must be empty.
+ */
+void rb_tree_build_sorted(rb_tree *tree, rb_tree_node **nodes, unsigned long n)
+{
+    unsigned long i;
+    int red_depth;
+
+    ASSERT(tree->root.left == tree->nil);
+    for (i = 1; i < n; i++)
+	ASSERT(tree->cmp(nodes[i-1], nodes[i]) < 0);
+
+    /* All leaves are at depth floor(log2(n)) or one above it. Coloring
+       the deepest level red gives the same black height on all paths. */
+    red_depth = 0;
+    while ((2UL << red_depth) <= n)
+	red_depth++;
+
+    set_root(tree, build_nodes(tree, nodes, n, 0, red_depth));
+    CHECK_TREE(tree, NULL);
+}
+
+
 void rb_tree_node_updated(rb_tree* tree, rb_tree_node* node)
 {
     rb_tree_node *root = &tree->root;
@@ -507,7 +772,7 @@ void rb_tree_node_updated(rb_tree* tree, rb_tree_node* node)
 static void check_node(rb_tree* tree, rb_tree_node* x, rb_tree_node* parent,
 		       rb_tree_node* offender)
 {
-    if (x != &tree->nil) {
+    if (x != tree->nil) {
 	ASSERT(x);
 	ASSERT(x->parent == parent);
 	ASSERT(tree->update_subtree(tree, x, 0) == 0);
@@ -518,13 +783,13 @@ static void check_node(rb_tree* tree, rb_tree_node* x, rb_tree_node* parent,
 
 void rb_tree_check(rb_tree* tree, rb_tree_node* offender)
 {
-    ASSERT(!tree->nil.red);
-    ASSERT(tree->nil.left == &tree->nil);
-    ASSERT(tree->nil.right == &tree->nil);
-    //ASSERT(tree->nil.parent == &tree->nil);
+    ASSERT(!tree->nil->red);
+    ASSERT(tree->nil->left == tree->nil);
+    ASSERT(tree->nil->right == tree->nil);
+    //ASSERT(tree->nil->parent == tree->nil);
     ASSERT(!tree->root.red);
-    ASSERT(tree->root.right == &tree->nil);
-    ASSERT(tree->root.parent == &tree->nil);
+    ASSERT(tree->root.right == tree->nil);
+    ASSERT(tree->root.parent == tree->nil);
     check_node(tree, tree->root.left, &tree->root, offender);
 }
 
@@ -40,9 +40,12 @@ typedef struct rb_tree
         root.left should always point to the node which is the root of the tree.
         nil should always be black but has aribtrary children and parent.
         The point of using these sentinels is so that the root and nil nodes
-        do not require special cases in the code */
+        do not require special cases in the code.
+        nil points to nil_node, or to the nil_node of the tree it was
+        split from, as nodes moved by split and join keep their leaves */
     rb_tree_node root;
-    rb_tree_node nil;
+    rb_tree_node* nil;
+    rb_tree_node nil_node;
 } rb_tree;
 
 
@@ -52,6 +55,7 @@ void rb_tree_init(rb_tree* newTree,
 		  rb_tree_cmp_key_FT*,
 		  rb_tree_update_subtree_FT*,
 		  rb_tree_print_node_FT*);
+void rb_tree_init_from(rb_tree* newTree, rb_tree* tree);
 rb_tree_node * rb_tree_insert(rb_tree*, rb_tree_node*);
 void rb_tree_print(rb_tree*);
 void rb_tree_remove(rb_tree*, rb_tree_node*);
@@ -61,5 +65,8 @@ rb_tree_node* rb_tree_succ(rb_tree*,rb_tree_node*);
 rb_tree_node* rb_tree_lookup_exact(rb_tree*, void*);
 rb_tree_node* rb_tree_lookup_maxle(rb_tree* tree, void* key);
 rb_tree_node* rb_tree_lookup_ming(rb_tree* tree, void* key);
+void rb_tree_split(rb_tree* tree, void* key, rb_tree* right);
+void rb_tree_join(rb_tree* tree, rb_tree* right);
+void rb_tree_build_sorted(rb_tree* tree, rb_tree_node** nodes, unsigned long n);
 void rb_tree_node_updated(rb_tree*, rb_tree_node*);
 void rb_tree_check(rb_tree* tree, rb_tree_node* offender);
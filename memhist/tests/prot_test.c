@@ -0,0 +1,96 @@
+/*
+ * Protection set and clear, run under memhist:
+ *   valgrind --tool=memhist ./prot_test
+ */
+#include <setjmp.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "valgrind/memhist.h"
+
+#define CHECK(C) ((C) ? (void)0 : check_error(#C, __FILE__,__LINE__))
+
+#define PAGE 4096
+#define BOTH (VG_MEM_NOWRITE | VG_MEM_NOREAD)
+
+static void check_error(const char* txt, const char* file, int line)
+{
+    fprintf(stderr, "CHECK(%s) FAILED at %s:%i\n", txt, file, line);
+    abort();
+}
+
+static char buf[3 * PAGE];
+static sigjmp_buf jmp_env;
+static volatile char sink;  /* unused loads are optimized away by VEX */
+
+static void segv_handler(int sig)
+{
+    siglongjmp(jmp_env, 1);
+}
+
+static int write_faults(char* p)
+{
+    if (sigsetjmp(jmp_env, 1))
+	return 1;
+    *(volatile char*)p = 1;
+    return 0;
+}
+
+static int read_faults(char* p)
+{
+    if (sigsetjmp(jmp_env, 1))
+	return 1;
+    sink = *(volatile char*)p;
+    return 0;
+}
+
+/* Clear part of a protected region, the rest keeps its old flags */
+static void test_clear_split(void)
+{
+    char* head = buf;
+    char* mid = buf + PAGE;
+    char* tail = buf + 2*PAGE;
+
+    /* clear one flag in the middle */
+    VALGRIND_SET_PROTECTION(buf, sizeof(buf), "buf", BOTH);
+    VALGRIND_CLEAR_PROTECTION(mid, PAGE, VG_MEM_NOREAD);
+    CHECK(read_faults(head) && write_faults(head));
+    CHECK(!read_faults(mid) && write_faults(mid));
+    CHECK(read_faults(tail) && write_faults(tail));
+
+    VALGRIND_CLEAR_PROTECTION(buf, sizeof(buf), BOTH);
+    CHECK(!read_faults(head) && !write_faults(head));
+    CHECK(!read_faults(mid) && !write_faults(mid));
+    CHECK(!read_faults(tail) && !write_faults(tail));
+
+    /* clear all flags in the middle */
+    VALGRIND_SET_PROTECTION(buf, sizeof(buf), "buf", BOTH);
+    VALGRIND_CLEAR_PROTECTION(mid, PAGE, BOTH);
+    CHECK(read_faults(head) && write_faults(head));
+    CHECK(!read_faults(mid) && !write_faults(mid));
+    CHECK(read_faults(tail) && write_faults(tail));
+    VALGRIND_CLEAR_PROTECTION(buf, sizeof(buf), BOTH);
+
+    /* clear one flag at the start */
+    VALGRIND_SET_PROTECTION(buf, sizeof(buf), "buf", BOTH);
+    VALGRIND_CLEAR_PROTECTION(head, PAGE, VG_MEM_NOREAD);
+    CHECK(!read_faults(head) && write_faults(head));
+    CHECK(read_faults(mid) && write_faults(mid));
+    CHECK(read_faults(tail) && write_faults(tail));
+    VALGRIND_CLEAR_PROTECTION(buf, sizeof(buf), BOTH);
+}
+
+int main(void)
+{
+    if (!RUNNING_ON_VALGRIND) {
+	fprintf(stderr, "Run under valgrind --tool=memhist\n");
+	return 1;
+    }
+    signal(SIGSEGV, segv_handler);
+
+    test_clear_split();
+
+    printf("All tests passed\n");
+    return 0;
+}
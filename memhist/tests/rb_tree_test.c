@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 
 #include "rb_tree.h"
 
@@ -36,10 +37,10 @@ int update_subtree(rb_tree* t, Node* node, int do_update)
 {
     int new_cnt = 1;
 
-    if (node->rb_node.left != &t->nil) {
+    if (node->rb_node.left != t->nil) {
 	new_cnt += left_node(node)->cnt;
     }
-    if (node->rb_node.right != &t->nil) {
+    if (node->rb_node.right != t->nil) {
 	new_cnt += right_node(node)->cnt;
     }
     if (new_cnt != node->cnt) {
@@ -58,6 +59,177 @@ void print_node(Node* node, int depth)
     printf("%.*s%li cnt=%d\n", depth*2, spaces, node->key, node->cnt);
 }
 
+/* Check red-black properties and 'cnt' of sub-tree, return black height.
+ */
+static int check_rb(rb_tree* t, rb_tree_node* x, long* prev_key, long* n)
+{
+    int lbh, rbh;
+
+    if (x == t->nil)
+	return 0;
+    CHECK(!x->red || (!x->left->red && !x->right->red));
+    lbh = check_rb(t, x->left, prev_key, n);
+    CHECK(((Node*)x)->key > *prev_key);
+    *prev_key = ((Node*)x)->key;
+    ++*n;
+    rbh = check_rb(t, x->right, prev_key, n);
+    CHECK(lbh == rbh);
+    CHECK(((Node*)x)->cnt == 1 + (x->left != t->nil ? left_node((Node*)x)->cnt : 0)
+	  + (x->right != t->nil ? right_node((Node*)x)->cnt : 0));
+    return lbh + !x->red;
+}
+
+/* Check whole tree, return number of nodes.
+ */
+static long check_all(rb_tree* t)
+{
+    long prev_key = -1;
+    long n = 0;
+
+    rb_tree_check(t, NULL);
+    CHECK(!t->root.left->red);
+    check_rb(t, t->root.left, &prev_key, &n);
+    CHECK(n == (t->root.left == t->nil ? 0 : ((Node*)t->root.left)->cnt));
+    return n;
+}
+
+static void init_tree(rb_tree* t)
+{
+    rb_tree_init(t, (rb_tree_cmp_FT*)cmp,
+		 (rb_tree_cmp_key_FT*)cmp_key,
+		 (rb_tree_update_subtree_FT*)update_subtree,
+		 (rb_tree_print_node_FT*)print_node);
+}
+
+static void test_split_join(void)
+{
+    enum { N = 300 };
+    static Node node[N];
+    rb_tree_node* nodes[N];
+    rb_tree t, r, m;
+    long n, k, lo, hi;
+
+    for (n = 0; n < N; n++) {
+	node[n].key = n;
+	nodes[n] = &node[n].rb_node;
+    }
+
+    /* build_sorted of all sizes */
+    for (n = 0; n <= N; n++) {
+	init_tree(&t);
+	rb_tree_build_sorted(&t, nodes, n);
+	CHECK(check_all(&t) == n);
+    }
+
+    /* split at every key, and join back, of trees built by insert */
+    for (n = 0; n <= N; n += 23) {
+	for (k = -1; k <= n; k++) {
+	    init_tree(&t);
+	    for (lo = 0; lo < n; lo++) {
+		long ix = (lo * 37) % n; /* insert out of order */
+		node[ix].cnt = 1;
+		CHECK(rb_tree_insert(&t, &node[ix].rb_node) == NULL);
+	    }
+	    rb_tree_split(&t, (void*)k, &r);
+	    lo = k < 0 ? 0 : (k > n ? n : k);
+	    CHECK(check_all(&t) == lo);
+	    CHECK(check_all(&r) == n - lo);
+	    CHECK(!lo || ((Node*)rb_tree_min(&t))->key == 0);
+	    CHECK(lo == n || ((Node*)rb_tree_min(&r))->key == lo);
+	    rb_tree_join(&t, &r);
+	    CHECK(check_all(&t) == n);
+	    CHECK(check_all(&r) == 0);
+	}
+    }
+
+    /* join trees of all size combinations */
+    for (lo = 0; lo <= 60; lo++) {
+	for (hi = lo; hi <= 120; hi++) {
+	    init_tree(&t);
+	    rb_tree_build_sorted(&t, nodes, lo);
+	    rb_tree_init_from(&r, &t);
+	    rb_tree_build_sorted(&r, nodes + lo, hi - lo);
+	    rb_tree_join(&t, &r);
+	    CHECK(check_all(&t) == hi);
+	}
+    }
+
+    /* cut out [lo,hi) and put back a rebuilt range */
+    for (lo = 0; lo < N; lo += 17) {
+	for (hi = lo; hi <= N; hi += 13) {
+	    init_tree(&t);
+	    rb_tree_build_sorted(&t, nodes, N);
+	    rb_tree_split(&t, (void*)lo, &r);
+	    rb_tree_split(&r, (void*)hi, &m);
+	    /* r now holds [lo,hi) and m the rest */
+	    CHECK(check_all(&r) == hi - lo);
+	    rb_tree_init_from(&r, &t);
+	    rb_tree_build_sorted(&r, nodes + lo, hi - lo);
+	    rb_tree_join(&t, &r);
+	    rb_tree_join(&t, &m);
+	    CHECK(check_all(&t) == N);
+	}
+    }
+}
+
+
+static double seconds(clock_t start)
+{
+    return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+/* Remove and reinsert ranges of 'k' nodes in a tree of 'n' nodes,
+ * node by node and with split/join/build_sorted.
+ */
+static void bench(long n, long k)
+{
+    Node* node = malloc(n * sizeof(Node));
+    rb_tree_node** nodes = malloc(n * sizeof(rb_tree_node*));
+    const long rounds = 20;
+    rb_tree t, r, m;
+    clock_t start;
+    double t_node, t_range;
+    long i, j, lo;
+
+    for (i = 0; i < n; i++) {
+	node[i].key = i;
+	nodes[i] = &node[i].rb_node;
+    }
+    init_tree(&t);
+    rb_tree_build_sorted(&t, nodes, n);
+
+    start = clock();
+    for (j = 0; j < rounds; j++) {
+	lo = (j * 7919) % (n - k);
+	for (i = lo; i < lo + k; i++)
+	    rb_tree_remove(&t, &node[i].rb_node);
+	for (i = lo; i < lo + k; i++) {
+	    node[i].cnt = 1;
+	    rb_tree_insert(&t, &node[i].rb_node);
+	}
+    }
+    t_node = seconds(start);
+    CHECK(check_all(&t) == n);
+
+    start = clock();
+    for (j = 0; j < rounds; j++) {
+	lo = (j * 7919) % (n - k);
+	rb_tree_split(&t, (void*)lo, &r);
+	rb_tree_split(&r, (void*)(lo + k), &m);
+	rb_tree_init_from(&r, &t);
+	rb_tree_build_sorted(&r, nodes + lo, k);
+	rb_tree_join(&t, &r);
+	rb_tree_join(&t, &m);
+    }
+    t_range = seconds(start);
+    CHECK(check_all(&t) == n);
+
+    printf("n=%-8li k=%-7li per-node %8.3f ms  split/join %8.3f ms\n",
+	   n, k, t_node * 1000 / rounds, t_range * 1000 / rounds);
+    free(nodes);
+    free(node);
+}
+
 int main()
 {
     rb_tree t;
@@ -170,5 +342,13 @@ int main()
 	//rb_tree_print(&t);
     }
     rb_tree_print(&t);
+
+    test_split_join();
+    printf("split/join tests passed\n");
+
+    bench(1000000, 10);
+    bench(1000000, 1000);
+    bench(1000000, 100000);
+    return 0;
 }
 